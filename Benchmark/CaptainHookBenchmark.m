@@ -0,0 +1,203 @@
+// Measures the cost of the code CaptainHook generates against plain message sends
+// Prints one "benchmark,iterations,nanoseconds per operation" line per benchmark, so results can be compared across releases
+//	CaptainHookBenchmark [iterations] [hooks to install]
+
+#import <Foundation/Foundation.h>
+#import <stdio.h>
+#import <stdlib.h>
+#import "../CaptainHook.h"
+
+@interface CHBenchBase : NSObject
+- (int)inherited:(int)value;
+- (int)superOptimized:(int)value;
+@end
+
+@interface CHBenchTarget : CHBenchBase
+- (int)plain:(int)value;
+- (int)replaced:(int)value;
+- (int)selfOptimized:(int)value;
+@end
+
+// Methods added at runtime by the hooks below
+@protocol CHBenchAdded
+- (int)added:(int)value;
+- (NSString *)retained;
+- (void)setRetained:(NSString *)retained;
+- (int)primitive;
+- (void)setPrimitive:(int)primitive;
+- (int)stored;
+- (void)setStored:(int)stored;
+- (int)value;
+@end
+
+@implementation CHBenchBase
+- (int)inherited:(int)value
+{
+	return value + 1;
+}
+- (int)superOptimized:(int)value
+{
+	return value + 1;
+}
+@end
+
+@implementation CHBenchTarget
+- (int)plain:(int)value
+{
+	return value + 1;
+}
+- (int)replaced:(int)value
+{
+	return value + 1;
+}
+- (int)selfOptimized:(int)value
+{
+	return value + 1;
+}
+@end
+
+CHDeclareClass(CHBenchTarget);
+CHDeclareClass(CHBenchStorage);
+CHDeclareClass(CHBenchInstall);
+// Sized for the default hook count; larger runs grow it
+CHDeclareHookBatch(CHBenchInstallBatch, 1000);
+
+CHMethod(1, int, CHBenchTarget, replaced, int, value)
+{
+	return CHSuper(1, CHBenchTarget, replaced, value);
+}
+
+CHMethod(1, int, CHBenchTarget, inherited, int, value)
+{
+	return CHSuper(1, CHBenchTarget, inherited, value);
+}
+
+CHOptimizedMethod(1, super, int, CHBenchTarget, superOptimized, int, value)
+{
+	return CHSuper(1, CHBenchTarget, superOptimized, value);
+}
+
+CHOptimizedMethod(1, self, int, CHBenchTarget, selfOptimized, int, value)
+{
+	return CHSuper(1, CHBenchTarget, selfOptimized, value);
+}
+
+CHOptimizedMethod(1, new, int, CHBenchTarget, added, int, value)
+{
+	return value + 1;
+}
+
+CHPropertyRetain(CHBenchTarget, NSString *, retained, setRetained)
+CHPrimitiveProperty(CHBenchTarget, int, primitive, setPrimitive, 0)
+CHIvarPrimitiveProperty(CHBenchStorage, int, stored, setStored)
+
+// Hooked once per runtime-created class by the installation benchmarks
+CHMethod(0, int, CHBenchInstall, value)
+{
+	return CHSuper(0, CHBenchInstall, value) + 1;
+}
+
+static int CHBenchValue(id self, SEL _cmd)
+{
+	return 1;
+}
+
+static volatile int CHBenchSink;
+
+#define CHBenchReport(label, iterations, nanoseconds) \
+	printf("%s,%lu,%.3f\n", label, (unsigned long)(iterations), (double)(nanoseconds) / (double)(iterations))
+
+// Runs statement a few times to warm caches, then times iterations of it (statement may use the loop counter _iteration)
+#define CHBenchmark(label, iterations, statement) do { \
+	for (unsigned long _iteration = 0; _iteration < 1000; _iteration++) { \
+		statement; \
+	} \
+	uint64_t _start = CHClockTicks(); \
+	for (unsigned long _iteration = 0; _iteration < (iterations); _iteration++) { \
+		statement; \
+	} \
+	CHBenchReport(label, iterations, CHClockTicksToNanoseconds(CHClockTicks() - _start)); \
+} while (0)
+
+static Class *CHBenchCreateClasses(const char *prefix, unsigned long count)
+{
+	Class *classes = malloc(sizeof(Class) * count);
+	for (unsigned long i = 0; i < count; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "%s%lu", prefix, i);
+		classes[i] = objc_allocateClassPair([NSObject class], name, 0);
+		class_addMethod(classes[i], @selector(value), (IMP)&CHBenchValue, "i@:");
+		objc_registerClassPair(classes[i]);
+	}
+	return classes;
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+	unsigned long hooks = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000;
+	@autoreleasepool {
+		CHLoadClass(CHBenchTarget);
+		CHRegisterClass(CHBenchStorage, CHBenchTarget) {
+			CHAddIvar(CHClass(CHBenchStorage), stored, int);
+		}
+		CHHook(1, CHBenchTarget, replaced);
+		CHHook(1, CHBenchTarget, inherited);
+		CHHook(1, CHBenchTarget, superOptimized);
+		CHHook(1, CHBenchTarget, selfOptimized);
+		CHHook(1, CHBenchTarget, added);
+		CHHookProperty(CHBenchTarget, retained, setRetained);
+		CHHookProperty(CHBenchTarget, primitive, setPrimitive);
+		CHHookProperty(CHBenchStorage, stored, setStored);
+
+		CHBenchTarget *target = [[CHBenchTarget alloc] init];
+		id added = target;
+		id storage = [[CHClass(CHBenchStorage) alloc] init];
+		NSString *string = @"CaptainHook";
+
+		printf("benchmark,iterations,ns_per_op\n");
+		CHBenchmark("objc_msgSend", iterations, CHBenchSink = [target plain:1]);
+		CHBenchmark("CHMethod.replaced", iterations, CHBenchSink = [target replaced:1]);
+		CHBenchmark("CHMethod.inherited", iterations, CHBenchSink = [target inherited:1]);
+		CHBenchmark("CHOptimizedMethod.super", iterations, CHBenchSink = [target superOptimized:1]);
+		CHBenchmark("CHOptimizedMethod.self", iterations, CHBenchSink = [target selfOptimized:1]);
+		CHBenchmark("CHOptimizedMethod.new", iterations, CHBenchSink = [added added:1]);
+		CHBenchmark("CHIvar.get", iterations, CHBenchSink = CHIvar(storage, stored, int));
+		CHBenchmark("CHIvar.set", iterations, CHIvar(storage, stored, int) = (int)_iteration);
+		CHBenchmark("CHPropertyRetain.get", iterations, CHBenchSink = [added retained] != nil);
+		CHBenchmark("CHPropertyRetain.set", iterations, [added setRetained:string]);
+		CHBenchmark("CHPrimitiveProperty.get", iterations, CHBenchSink = [added primitive]);
+		CHBenchmark("CHPrimitiveProperty.set", iterations, [added setPrimitive:(int)_iteration]);
+		CHBenchmark("CHIvarPrimitiveProperty.get", iterations, CHBenchSink = [storage stored]);
+		CHBenchmark("CHIvarPrimitiveProperty.set", iterations, [storage setStored:(int)_iteration]);
+
+		// Installation is timed once over all classes, so it is reported per hook; CHLoadClass sends +class to its argument,
+		// so a Class variable named after the declaration loads each class created at runtime
+		Class *classes = CHBenchCreateClasses("CHBenchInstallHook", hooks);
+		uint64_t start = CHClockTicks();
+		for (unsigned long i = 0; i < hooks; i++) {
+			Class CHBenchInstall = classes[i];
+			CHLoadClass(CHBenchInstall);
+			CHHook(0, CHBenchInstall, value);
+		}
+		CHBenchReport("CHHook.install", hooks, CHClockTicksToNanoseconds(CHClockTicks() - start));
+		free(classes);
+
+		classes = CHBenchCreateClasses("CHBenchInstallBatch", hooks);
+		start = CHClockTicks();
+		for (unsigned long i = 0; i < hooks; i++) {
+			Class CHBenchInstall = classes[i];
+			CHLoadClass(CHBenchInstall);
+			CHBatchHook(0, CHBenchInstallBatch, CHBenchInstall, value);
+		}
+		CHCommitHookBatch(CHBenchInstallBatch);
+		CHBenchReport("CHCommitHookBatch.install", hooks, CHClockTicksToNanoseconds(CHClockTicks() - start));
+		free(classes);
+
+#ifndef CHHasARC
+		[storage release];
+		[target release];
+#endif
+	}
+	return 0;
+}
@@ -1,7 +1,20 @@
 // Possible defines:
 //	CHDebug           if defined, CHDebugLog is equivalent to CHLog; else, emits no code
 //	CHUseSubstrate    if defined, uses MSMessageHookEx to hook methods, otherwise uses internal hooking routines. Warning! super call closures are only available on ARM platforms for recent releases of MobileSubstrate
-//	CHEnableProfiling if defined, enables calls to CHProfileScope()
+//	CHEnableProfiling if defined, enables calls to CHProfileScope(); statistics are aggregated per thread and scope and logged by CHProfileReport() and at exit (see CHProfileSiteCapacity, CHProfileLabelCapacity)
+//	CHClockUseCycleCounter if defined, CHClockTicks() (used for profiling) reads the CPU cycle counter (rdtsc/cntvct_el0) instead of mach_absolute_time/clock_gettime
+//	CHInstrumentHooks if defined, every replacement method counts its calls; see CHEnumerateHookStats() and CHHookStatsReport()
+//	CHInstrumentHookTiming if defined along with CHInstrumentHooks, also measures time spent in each replacement and its CHSuper calls
+//	CHAsyncLog        if defined, CHLog and CHLogSource format into a bounded ring buffer that a background thread writes to NSLog (see CHAsyncLogCapacity, CHAsyncLogLineLength)
+//	CHLogMinimumLevel if defined, CHLogDebug/CHLogInfo/CHLogWarning/CHLogError below this level emit no code (defaults to CHLogLevelDebug with CHDebug, else CHLogLevelInfo)
+//	CHSharedClassDeclarations if defined, CHDeclareClass declarations are shared between all translation units of an image and CHLoadLateClass only looks up classes that are not yet loaded
+//	CHSelectorTable   if defined, the selectors of all CHMethod hooks in an image are registered together at load and hooks and CHSuper calls use the registered slots (for runtimes without static selector fix-up, such as GNUstep)
+//	CHThreadSafeHooks if defined, the internal hooking routines publish each hook's super IMP atomically before swapping in the replacement, so threads already messaging the class never call through a missing or stale super pointer
+//	CHHookQuiescence  if defined, replacements count the threads inside them and CHUnhook/CHReplaceHook wait, up to CHHookQuiescenceTimeout microseconds, until no thread is counted inside the replaced code (see CHHookQuiescenceGracePeriod)
+//	CHCacheSuperIMP   if defined, super call closures cache the superclass IMP until CHInvalidateSuperCache() is called (CaptainHook's own hooks invalidate automatically)
+//	CHTrackAutoreleaseHighWater if defined on Apple platforms, CHAutoreleaseScope/CHDeclareAutoreleaseDrain estimate the most objects autoreleased per scope; see CHAutoreleaseHighWaterReport()
+//	CHEnableTracing   if defined, every replacement records its entry and exit into the file started with CHTraceStart() (see Tools/chtrace-decode.c)
+//	CHMemoCacheSize   number of results each thread keeps per memoizing method (CHOptimizedMethod with memo); defaults to 8, see also CHMemoKeyLength
 //  CHAppName         should be set to the name of the application (if not, defaults to "CaptainHook"); used for logging and profiling
 
 #import <objc/runtime.h>
@@ -30,8 +43,13 @@
 
 #define CHLocationInSource [NSString stringWithFormat:@CHStringify(__LINE__) " in %s", __FUNCTION__]
 
-#define CHLog(args...)			NSLog(@CHAppName ": %@", [NSString stringWithFormat:args])
-#define CHLogSource(args...)	NSLog(@CHAppName " @ " CHStringify(__LINE__) " in %s: %@", __FUNCTION__, [NSString stringWithFormat:args])
+#ifdef CHAsyncLog
+	#define CHLog(args...)			CHAsyncLogFormat_(NULL, 0, args)
+	#define CHLogSource(args...)	CHAsyncLogFormat_(__FUNCTION__, __LINE__, args)
+#else
+	#define CHLog(args...)			NSLog(@CHAppName ": %@", [NSString stringWithFormat:args])
+	#define CHLogSource(args...)	NSLog(@CHAppName " @ " CHStringify(__LINE__) " in %s: %@", __FUNCTION__, [NSString stringWithFormat:args])
+#endif
 
 #ifdef CHDebug
 	#define CHDebugLog(args...)			CHLog(args)
@@ -41,10 +59,445 @@
 	#define CHDebugLogSource(args...)	CHNothing()
 #endif
 
+// Leveled logging; levels below CHLogMinimumLevel emit no code
+#define CHLogLevelDebug		0
+#define CHLogLevelInfo		1
+#define CHLogLevelWarning	2
+#define CHLogLevelError		3
+#define CHLogLevelNone		4
+#ifndef CHLogMinimumLevel
+	#ifdef CHDebug
+		#define CHLogMinimumLevel CHLogLevelDebug
+	#else
+		#define CHLogMinimumLevel CHLogLevelInfo
+	#endif
+#endif
+#if CHLogMinimumLevel <= CHLogLevelDebug
+	#define CHLogDebug(args...)			CHLog(args)
+#else
+	#define CHLogDebug(args...)			CHNothing()
+#endif
+#if CHLogMinimumLevel <= CHLogLevelInfo
+	#define CHLogInfo(args...)			CHLog(args)
+#else
+	#define CHLogInfo(args...)			CHNothing()
+#endif
+#if CHLogMinimumLevel <= CHLogLevelWarning
+	#define CHLogWarning(args...)		CHLog(args)
+#else
+	#define CHLogWarning(args...)		CHNothing()
+#endif
+#if CHLogMinimumLevel <= CHLogLevelError
+	#define CHLogError(args...)			CHLog(args)
+#else
+	#define CHLogError(args...)			CHNothing()
+#endif
+
+// Logs at most perSecond messages per second from this call site (with bursts of up to perSecond), then reports how many were suppressed
+#define CHLogRateLimited(perSecond, args...) \
+	do { \
+		static uint64_t _rateLimitState; \
+		static uint64_t _rateLimitSuppressed; \
+		if (CHLogRateLimitAcquire_(&_rateLimitState, &_rateLimitSuppressed, perSecond)) { \
+			uint64_t _suppressed = __atomic_exchange_n(&_rateLimitSuppressed, 0, __ATOMIC_RELAXED); \
+			if (_suppressed) \
+				CHLog(@"%llu messages suppressed", (unsigned long long)_suppressed); \
+			CHLog(args); \
+		} \
+	} while(0)
+
 // Constructor
 #define CHConstructor static __attribute__((constructor)) void CHConcat(CHConstructor, __LINE__)()
 #define CHInline inline __attribute__((always_inline))
 
+// Asynchronous Logging (CHLog formats into a fixed ring of lines that a background thread writes out; lines are dropped and counted when the ring is full)
+#ifdef CHAsyncLog
+	#import <Foundation/NSString.h>
+	#import <pthread.h>
+	#import <stdarg.h>
+	#import <stdio.h>
+	#import <stdlib.h>
+	#import <string.h>
+	#ifndef CHAsyncLogCapacity
+		#define CHAsyncLogCapacity 256
+	#endif
+	#ifndef CHAsyncLogLineLength
+		#define CHAsyncLogLineLength 256
+	#endif
+	struct CHAsyncLogLine_ {
+		uint64_t sequence;
+		const char *function;
+		int line;
+		char text[CHAsyncLogLineLength];
+	};
+	struct CHAsyncLog_ {
+		uint64_t head;
+		uint64_t tail;
+		uint64_t dropped;
+		int exiting;
+		int sleeping;
+		pthread_mutex_t drainLock;
+		pthread_mutex_t wakeLock;
+		pthread_cond_t wake;
+		struct CHAsyncLogLine_ lines[CHAsyncLogCapacity];
+	};
+	__attribute__((weak, visibility("hidden"))) struct CHAsyncLog_ CHAsyncLogRing_ = { 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+	__attribute__((weak, visibility("hidden"))) pthread_once_t CHAsyncLogOnce_ = PTHREAD_ONCE_INIT;
+	__attribute__((unused))
+	static int CHAsyncLogDrain_()
+	{
+		struct CHAsyncLog_ *ring = &CHAsyncLogRing_;
+		int drained = 0;
+		pthread_mutex_lock(&ring->drainLock);
+		for (;;) {
+			struct CHAsyncLogLine_ *line = &ring->lines[ring->tail % CHAsyncLogCapacity];
+			if (__atomic_load_n(&line->sequence, __ATOMIC_ACQUIRE) != ring->tail + 1)
+				break;
+			@autoreleasepool {
+				// %s would be read in the system encoding rather than UTF-8
+				NSString *text = [NSString stringWithUTF8String:line->text];
+				if (line->function)
+					NSLog(@CHAppName " @ %d in %s: %@", line->line, line->function, text);
+				else
+					NSLog(@CHAppName ": %@", text);
+			}
+			__atomic_store_n(&line->sequence, ring->tail + CHAsyncLogCapacity, __ATOMIC_RELEASE);
+			ring->tail++;
+			drained = 1;
+		}
+		uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped) {
+			@autoreleasepool {
+				NSLog(@CHAppName ": %llu log messages dropped", (unsigned long long)dropped);
+			}
+		}
+		pthread_mutex_unlock(&ring->drainLock);
+		return drained;
+	}
+	__attribute__((unused))
+	static int CHAsyncLogPending_()
+	{
+		struct CHAsyncLog_ *ring = &CHAsyncLogRing_;
+		pthread_mutex_lock(&ring->drainLock);
+		int pending = __atomic_load_n(&ring->lines[ring->tail % CHAsyncLogCapacity].sequence, __ATOMIC_ACQUIRE) == ring->tail + 1 || __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&ring->drainLock);
+		return pending;
+	}
+	// The writer sleeps until a producer finds it asleep after publishing a line; both sides store then fence then load, so one of them always sees the other
+	__attribute__((unused))
+	static void *CHAsyncLogThread_(void *context)
+	{
+		struct CHAsyncLog_ *ring = &CHAsyncLogRing_;
+		for (;;) {
+			if (CHAsyncLogDrain_())
+				continue;
+			pthread_mutex_lock(&ring->wakeLock);
+			__atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (!CHAsyncLogPending_())
+				pthread_cond_wait(&ring->wake, &ring->wakeLock);
+			__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&ring->wakeLock);
+		}
+		return NULL;
+	}
+	__attribute__((unused))
+	static void CHAsyncLogWake_(struct CHAsyncLog_ *ring)
+	{
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED)) {
+			pthread_mutex_lock(&ring->wakeLock);
+			pthread_cond_signal(&ring->wake);
+			pthread_mutex_unlock(&ring->wakeLock);
+		}
+	}
+	__attribute__((unused))
+	static void CHAsyncLogFlushAtExit_()
+	{
+		__atomic_store_n(&CHAsyncLogRing_.exiting, 1, __ATOMIC_RELEASE);
+		CHAsyncLogDrain_();
+	}
+	__attribute__((unused))
+	static void CHAsyncLogStart_()
+	{
+		for (uint64_t i = 0; i < CHAsyncLogCapacity; i++)
+			__atomic_store_n(&CHAsyncLogRing_.lines[i].sequence, i, __ATOMIC_RELAXED);
+		pthread_t thread;
+		pthread_attr_t attributes;
+		pthread_attr_init(&attributes);
+		pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+		pthread_create(&thread, &attributes, CHAsyncLogThread_, NULL);
+		pthread_attr_destroy(&attributes);
+		atexit(CHAsyncLogFlushAtExit_);
+	}
+	// Formats without building an NSString: each conversion but %@ is passed to snprintf on its own, and %@ copies the object's description
+	__attribute__((unused))
+	static void CHAsyncLogPrint_(char *buffer, const char *format, va_list arguments)
+	{
+		size_t used = 0;
+		while (*format && used < CHAsyncLogLineLength - 1) {
+			if (*format != '%') {
+				buffer[used++] = *format++;
+				continue;
+			}
+			char spec[32] = "%";
+			size_t length = 1;
+			format++;
+			while (*format && strchr("-+ #0'", *format) && length < 8)
+				spec[length++] = *format++;
+			for (int precision = 0; precision < 2; precision++) {
+				if (precision) {
+					if (*format != '.')
+						break;
+					spec[length++] = *format++;
+				}
+				if (*format == '*') {
+					length += snprintf(&spec[length], 12, "%d", va_arg(arguments, int));
+					format++;
+				} else {
+					while (*format >= '0' && *format <= '9' && length < 20)
+						spec[length++] = *format++;
+				}
+			}
+			// 0 int, 1 long, 2 long long, 3 size_t, 4 intmax_t, 5 ptrdiff_t, 6 long double
+			int size = 0;
+			while (*format && strchr("hlqLzjt", *format) && length < 30) {
+				switch (*format) {
+					case 'l': size = size == 1 ? 2 : 1; break;
+					case 'q': size = 2; break;
+					case 'z': size = 3; break;
+					case 'j': size = 4; break;
+					case 't': size = 5; break;
+					case 'L': size = 6; break;
+				}
+				spec[length++] = *format++;
+			}
+			char conversion = *format;
+			if (!conversion)
+				break;
+			format++;
+			spec[length++] = conversion;
+			spec[length] = '\0';
+			char *output = &buffer[used];
+			size_t available = CHAsyncLogLineLength - used;
+			int written = 0;
+			switch (conversion) {
+				case '%':
+					buffer[used] = '%';
+					written = 1;
+					break;
+				case '@': {
+					id object = va_arg(arguments, id);
+					@autoreleasepool {
+						const char *description = object ? [[object description] UTF8String] : "(null)";
+						written = snprintf(output, available, "%s", description ?: "");
+					}
+					break;
+				}
+				case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+					switch (size) {
+						case 1: written = snprintf(output, available, spec, va_arg(arguments, long)); break;
+						case 2: written = snprintf(output, available, spec, va_arg(arguments, long long)); break;
+						case 3: written = snprintf(output, available, spec, va_arg(arguments, size_t)); break;
+						case 4: written = snprintf(output, available, spec, va_arg(arguments, intmax_t)); break;
+						case 5: written = snprintf(output, available, spec, va_arg(arguments, ptrdiff_t)); break;
+						default: written = snprintf(output, available, spec, va_arg(arguments, int)); break;
+					}
+					break;
+				case 'c': case 'C':
+					written = snprintf(output, available, spec, va_arg(arguments, int));
+					break;
+				case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+					if (size == 6)
+						written = snprintf(output, available, spec, va_arg(arguments, long double));
+					else
+						written = snprintf(output, available, spec, va_arg(arguments, double));
+					break;
+				case 's': case 'S': case 'p':
+					written = snprintf(output, available, spec, va_arg(arguments, void *));
+					break;
+				case 'n':
+					(void)va_arg(arguments, void *);
+					break;
+				default:
+					// Unknown conversion; its arguments cannot be skipped, so the rest of the line is dropped
+					written = snprintf(output, available, "%s", spec);
+					format = "";
+					break;
+			}
+			if (written > 0)
+				used += (size_t)written < available ? (size_t)written : available - 1;
+		}
+		if (used == CHAsyncLogLineLength - 1) {
+			// Truncated; drop a trailing character that was cut in the middle of its UTF-8 sequence
+			size_t lead = used;
+			while (lead && ((unsigned char)buffer[lead - 1] & 0xc0) == 0x80)
+				lead--;
+			if (lead && (unsigned char)buffer[lead - 1] >= 0xc0) {
+				unsigned char byte = (unsigned char)buffer[lead - 1];
+				size_t expected = byte >= 0xf0 ? 4 : byte >= 0xe0 ? 3 : 2;
+				if (used - (lead - 1) < expected)
+					used = lead - 1;
+			}
+		}
+		buffer[used] = '\0';
+	}
+	__attribute__((unused))
+	static void CHAsyncLogFormat_(const char *function, int line, NSString *format, ...)
+	{
+		// Literal formats hand out their bytes without copying
+		const char *text = [format UTF8String];
+		va_list arguments;
+		va_start(arguments, format);
+		pthread_once(&CHAsyncLogOnce_, CHAsyncLogStart_);
+		struct CHAsyncLog_ *ring = &CHAsyncLogRing_;
+		if (__atomic_load_n(&ring->exiting, __ATOMIC_ACQUIRE)) {
+			// The writer may already be gone
+			char buffer[CHAsyncLogLineLength];
+			CHAsyncLogPrint_(buffer, text, arguments);
+			if (function)
+				NSLog(@CHAppName " @ %d in %s: %@", line, function, [NSString stringWithUTF8String:buffer]);
+			else
+				NSLog(@CHAppName ": %@", [NSString stringWithUTF8String:buffer]);
+		} else {
+			uint64_t position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+			struct CHAsyncLogLine_ *slot;
+			for (;;) {
+				slot = &ring->lines[position % CHAsyncLogCapacity];
+				int64_t difference = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+				if (difference == 0) {
+					if (__atomic_compare_exchange_n(&ring->head, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+						break;
+				} else if (difference < 0) {
+					slot = NULL;
+					break;
+				} else {
+					position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+				}
+			}
+			if (slot) {
+				// The slot is ours until its sequence is published, so the line is formatted in place
+				slot->function = function;
+				slot->line = line;
+				CHAsyncLogPrint_(slot->text, text, arguments);
+				__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+			} else {
+				__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+			}
+			CHAsyncLogWake_(ring);
+		}
+		va_end(arguments);
+	}
+#endif
+
+// Monotonic Clock (CHClockTicks() is cheap to read; convert differences with CHClockTicksToNanoseconds())
+#if defined(CHClockUseCycleCounter) && (defined(__x86_64__) || defined(__aarch64__))
+	#import <time.h>
+	#ifdef __x86_64__
+		#import <x86intrin.h>
+	#endif
+	__attribute__((weak, visibility("hidden"))) uint64_t CHClockScale_;
+	__attribute__((unused)) CHInline
+	static uint64_t CHClockTicks()
+	{
+	#ifdef __x86_64__
+		return __rdtsc();
+	#else
+		uint64_t ticks;
+		__asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r" (ticks));
+		return ticks;
+	#endif
+	}
+	__attribute__((unused))
+	static uint64_t CHClockCalibrate_()
+	{
+		// Nanoseconds per tick in 32.32 fixed point
+	#ifdef __x86_64__
+		struct timespec start, now;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		uint64_t startTicks = CHClockTicks();
+		uint64_t elapsed;
+		do {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = (uint64_t)(now.tv_sec - start.tv_sec) * 1000000000ull + (uint64_t)now.tv_nsec - (uint64_t)start.tv_nsec;
+		} while (elapsed < 5000000);
+		uint64_t ticks = CHClockTicks() - startTicks;
+	#else
+		uint64_t ticks;
+		__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r" (ticks));
+		uint64_t elapsed = 1000000000ull;
+	#endif
+		uint64_t scale = (uint64_t)(((__uint128_t)elapsed << 32) / ticks);
+		__atomic_store_n(&CHClockScale_, scale, __ATOMIC_RELAXED);
+		return scale;
+	}
+	__attribute__((unused)) CHInline
+	static uint64_t CHClockTicksToNanoseconds(uint64_t ticks)
+	{
+		uint64_t scale = __atomic_load_n(&CHClockScale_, __ATOMIC_RELAXED);
+		if (__builtin_expect(!scale, 0))
+			scale = CHClockCalibrate_();
+		return (uint64_t)(((__uint128_t)ticks * scale) >> 32);
+	}
+#elif defined(__APPLE__)
+	#import <mach/mach_time.h>
+	__attribute__((unused)) CHInline
+	static uint64_t CHClockTicks()
+	{
+		return mach_absolute_time();
+	}
+	__attribute__((unused)) CHInline
+	static uint64_t CHClockTicksToNanoseconds(uint64_t ticks)
+	{
+		static mach_timebase_info_data_t info;
+		if (__builtin_expect(!info.denom, 0))
+			mach_timebase_info(&info);
+		return (ticks * info.numer) / info.denom;
+	}
+#else
+	#import <time.h>
+	__attribute__((unused)) CHInline
+	static uint64_t CHClockTicks()
+	{
+		struct timespec now;
+	#ifdef CLOCK_MONOTONIC_RAW
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	#else
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	#endif
+		return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+	}
+	__attribute__((unused)) CHInline
+	static uint64_t CHClockTicksToNanoseconds(uint64_t ticks)
+	{
+		return ticks;
+	}
+#endif
+
+// Token bucket behind CHLogRateLimited; state packs the last refill time in milliseconds (upper 48 bits) with the remaining tokens (lower 16 bits)
+__attribute__((unused))
+static int CHLogRateLimitAcquire_(uint64_t *state, uint64_t *suppressed, unsigned perSecond)
+{
+	uint64_t limit = perSecond < 0xffff ? perSecond : 0xffff;
+	uint64_t now = CHClockTicksToNanoseconds(CHClockTicks()) / 1000000;
+	uint64_t old = __atomic_load_n(state, __ATOMIC_RELAXED);
+	for (;;) {
+		uint64_t last = old ? old >> 16 : now;
+		uint64_t tokens = old ? old & 0xffff : limit;
+		uint64_t refill = (now - last) * limit / 1000;
+		if (refill) {
+			tokens = tokens + refill < limit ? tokens + refill : limit;
+			last = now;
+		}
+		if (!tokens) {
+			__atomic_add_fetch(suppressed, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+		if (__atomic_compare_exchange_n(state, &old, (last << 16) | (tokens - 1), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return 1;
+	}
+}
+
 // Cached Class Declaration (allows hooking methods, and fast lookup of classes)
 struct CHClassDeclaration_ {
 	Class class_;
@@ -52,19 +505,36 @@ struct CHClassDeclaration_ {
 	Class superClass_;
 };
 typedef struct CHClassDeclaration_ CHClassDeclaration_;
+#ifdef CHSharedClassDeclarations
+// Every translation unit that declares the class shares one weak declaration per image, so the class is only looked up once
+#define CHDeclareClass(name) \
+	@class name; \
+	__attribute__((weak, visibility("hidden"))) CHClassDeclaration_ name ## $;
+#else
 #define CHDeclareClass(name) \
 	@class name; \
 	static CHClassDeclaration_ name ## $;
+#endif
 
 // Loading Cached Classes (use CHLoadClass when class is linkable, CHLoadLateClass when it isn't)
 static inline Class CHLoadClass_(CHClassDeclaration_ *declaration, Class value)
 {
-	declaration->class_ = value;
 	declaration->metaClass_ = object_getClass(value);
 	declaration->superClass_ = class_getSuperclass(value);
+	// Published last so that a reader which sees class_ also sees the other two fields
+	__atomic_store_n(&declaration->class_, value, __ATOMIC_RELEASE);
 	return value;
 }
-#define CHLoadLateClass(name) CHLoadClass_(&name ## $, objc_getClass(#name))
+static inline Class CHLoadLateClass_(CHClassDeclaration_ *declaration, const char *name)
+{
+#ifdef CHSharedClassDeclarations
+	Class value = __atomic_load_n(&declaration->class_, __ATOMIC_ACQUIRE);
+	if (value)
+		return value;
+#endif
+	return CHLoadClass_(declaration, objc_getClass(name));
+}
+#define CHLoadLateClass(name) CHLoadLateClass_(&name ## $, #name)
 #define CHLoadClass(name) CHLoadClass_(&name ## $, [name class])
 
 // Quick Lookup of cached classes, and common methods on them
@@ -77,333 +547,886 @@ static inline Class CHLoadClass_(CHClassDeclaration_ *declaration, Class value)
 #define CHRespondsTo(obj, sel) [obj respondsToSelector:@selector(sel)]
 
 // Replacement Method Definition
+// Method signatures are assembled from @encode at compile time in Objective-C++, and once into static storage in Objective-C
+#if defined(__cplusplus) && __cplusplus >= 201402L
+template <typename T>
+constexpr const char *CHEncoding_()
+{
+	return @encode(T);
+}
+template <typename R, typename... A>
+constexpr size_t CHSigLength_()
+{
+	const char *encodings[] = { CHEncoding_<R>(), CHEncoding_<A>()... };
+	size_t length = 2;
+	for (const char *encoding : encodings)
+		while (*encoding++)
+			length++;
+	return length;
+}
+template <size_t Length>
+struct CHSig_ {
+	char value_[Length + 1];
+};
+template <typename R, typename... A>
+constexpr CHSig_<CHSigLength_<R, A...>()> CHBuildSig_()
+{
+	CHSig_<CHSigLength_<R, A...>()> result {};
+	const char *encodings[] = { CHEncoding_<A>()..., nullptr };
+	size_t offset = 0;
+	for (const char *c = CHEncoding_<R>(); *c; c++)
+		result.value_[offset++] = *c;
+	result.value_[offset++] = _C_ID;
+	result.value_[offset++] = _C_SEL;
+	for (size_t i = 0; encodings[i]; i++)
+		for (const char *c = encodings[i]; *c; c++)
+			result.value_[offset++] = *c;
+	result.value_[offset] = '\0';
+	return result;
+}
+// Accepts any number of argument types
+#define CHDeclareSig_(return_type, types...) \
+	static constexpr auto sig_ = CHBuildSig_<return_type, ##types>(); \
+	const char *sig = sig_.value_;
 #define CHDeclareSig0_(return_type) \
-	const char *return_ = @encode(return_type); \
-	size_t return_len = __builtin_strlen(return_); \
-	char sig[return_len+2+1]; \
-	__builtin_memcpy(sig, return_, return_len); \
-	sig[return_len] = _C_ID; \
-	sig[return_len+1] = _C_SEL; \
-	sig[return_len+2] = '\0';
+	CHDeclareSig_(return_type)
 #define CHDeclareSig1_(return_type, type1) \
-	const char *return_ = @encode(return_type); \
-	size_t return_len = __builtin_strlen(return_); \
-	const char *type1_ = @encode(type1); \
-	size_t type1_len = __builtin_strlen(type1_); \
-	char sig[return_len+2+type1_len+1]; \
-	__builtin_memcpy(sig, return_, return_len); \
-	sig[return_len] = _C_ID; \
-	sig[return_len+1] = _C_SEL; \
-	__builtin_memcpy(&sig[return_len+2], type1_, type1_len); \
-	sig[return_len+type1_len+2] = '\0';
+	CHDeclareSig_(return_type, type1)
 #define CHDeclareSig2_(return_type, type1, type2) \
-	const char *return_ = @encode(return_type); \
-	size_t return_len = __builtin_strlen(return_); \
-	const char *type1_ = @encode(type1); \
-	size_t type1_len = __builtin_strlen(type1_); \
-	const char *type2_ = @encode(type2); \
-	size_t type2_len = __builtin_strlen(type2_); \
-	char sig[return_len+2+type1_len+type2_len+1]; \
-	__builtin_memcpy(sig, return_, return_len); \
-	sig[return_len] = _C_ID; \
-	sig[return_len+1] = _C_SEL; \
-	__builtin_memcpy(&sig[return_len+2], type1_, type1_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len], type2_, type2_len); \
-	sig[return_len+type1_len+type2_len+2] = '\0';
+	CHDeclareSig_(return_type, type1, type2)
 #define CHDeclareSig3_(return_type, type1, type2, type3) \
-	const char *return_ = @encode(return_type); \
-	size_t return_len = __builtin_strlen(return_); \
-	const char *type1_ = @encode(type1); \
-	size_t type1_len = __builtin_strlen(type1_); \
-	const char *type2_ = @encode(type2); \
-	size_t type2_len = __builtin_strlen(type2_); \
-	const char *type3_ = @encode(type3); \
-	size_t type3_len = __builtin_strlen(type3_); \
-	char sig[return_len+2+type1_len+type2_len+type3_len+1]; \
-	__builtin_memcpy(sig, return_, return_len); \
-	sig[return_len] = _C_ID; \
-	sig[return_len+1] = _C_SEL; \
-	__builtin_memcpy(&sig[return_len+2], type1_, type1_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len], type2_, type2_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len], type3_, type3_len); \
-	sig[return_len+type1_len+type2_len+type3_len+2] = '\0';
+	CHDeclareSig_(return_type, type1, type2, type3)
 #define CHDeclareSig4_(return_type, type1, type2, type3, type4) \
-	const char *return_ = @encode(return_type); \
-	size_t return_len = __builtin_strlen(return_); \
-	const char *type1_ = @encode(type1); \
-	size_t type1_len = __builtin_strlen(type1_); \
-	const char *type2_ = @encode(type2); \
-	size_t type2_len = __builtin_strlen(type2_); \
-	const char *type3_ = @encode(type3); \
-	size_t type3_len = __builtin_strlen(type3_); \
-	const char *type4_ = @encode(type4); \
-	size_t type4_len = __builtin_strlen(type4_); \
-	char sig[return_len+2+type1_len+type2_len+type3_len+type4_len+1]; \
-	__builtin_memcpy(sig, return_, return_len); \
-	sig[return_len] = _C_ID; \
-	sig[return_len+1] = _C_SEL; \
-	__builtin_memcpy(&sig[return_len+2], type1_, type1_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len], type2_, type2_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len], type3_, type3_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len], type4_, type4_len); \
-	sig[return_len+type1_len+type2_len+type3_len+type4_len+2] = '\0';
+	CHDeclareSig_(return_type, type1, type2, type3, type4)
 #define CHDeclareSig5_(return_type, type1, type2, type3, type4, type5) \
-	const char *return_ = @encode(return_type); \
-	size_t return_len = __builtin_strlen(return_); \
-	const char *type1_ = @encode(type1); \
-	size_t type1_len = __builtin_strlen(type1_); \
-	const char *type2_ = @encode(type2); \
-	size_t type2_len = __builtin_strlen(type2_); \
-	const char *type3_ = @encode(type3); \
-	size_t type3_len = __builtin_strlen(type3_); \
-	const char *type4_ = @encode(type4); \
-	size_t type4_len = __builtin_strlen(type4_); \
-	const char *type5_ = @encode(type5); \
-	size_t type5_len = __builtin_strlen(type5_); \
-	char sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len+1]; \
-	__builtin_memcpy(sig, return_, return_len); \
-	sig[return_len] = _C_ID; \
-	sig[return_len+1] = _C_SEL; \
-	__builtin_memcpy(&sig[return_len+2], type1_, type1_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len], type2_, type2_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len], type3_, type3_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len], type4_, type4_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len], type5_, type5_len); \
-	sig[return_len+type1_len+type2_len+type3_len+type4_len+type5_len+2] = '\0';
+	CHDeclareSig_(return_type, type1, type2, type3, type4, type5)
 #define CHDeclareSig6_(return_type, type1, type2, type3, type4, type5, type6) \
-	const char *return_ = @encode(return_type); \
-	size_t return_len = __builtin_strlen(return_); \
-	const char *type1_ = @encode(type1); \
-	size_t type1_len = __builtin_strlen(type1_); \
-	const char *type2_ = @encode(type2); \
-	size_t type2_len = __builtin_strlen(type2_); \
-	const char *type3_ = @encode(type3); \
-	size_t type3_len = __builtin_strlen(type3_); \
-	const char *type4_ = @encode(type4); \
-	size_t type4_len = __builtin_strlen(type4_); \
-	const char *type5_ = @encode(type5); \
-	size_t type5_len = __builtin_strlen(type5_); \
-	const char *type6_ = @encode(type6); \
-	size_t type6_len = __builtin_strlen(type6_); \
-	char sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len+1]; \
-	__builtin_memcpy(sig, return_, return_len); \
-	sig[return_len] = _C_ID; \
-	sig[return_len+1] = _C_SEL; \
-	__builtin_memcpy(&sig[return_len+2], type1_, type1_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len], type2_, type2_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len], type3_, type3_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len], type4_, type4_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len], type5_, type5_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len], type6_, type6_len); \
-	sig[return_len+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len+2] = '\0';
+	CHDeclareSig_(return_type, type1, type2, type3, type4, type5, type6)
 #define CHDeclareSig7_(return_type, type1, type2, type3, type4, type5, type6, type7) \
-	const char *return_ = @encode(return_type); \
-	size_t return_len = __builtin_strlen(return_); \
-	const char *type1_ = @encode(type1); \
-	size_t type1_len = __builtin_strlen(type1_); \
-	const char *type2_ = @encode(type2); \
-	size_t type2_len = __builtin_strlen(type2_); \
-	const char *type3_ = @encode(type3); \
-	size_t type3_len = __builtin_strlen(type3_); \
-	const char *type4_ = @encode(type4); \
-	size_t type4_len = __builtin_strlen(type4_); \
-	const char *type5_ = @encode(type5); \
-	size_t type5_len = __builtin_strlen(type5_); \
-	const char *type6_ = @encode(type6); \
-	size_t type6_len = __builtin_strlen(type6_); \
-	const char *type7_ = @encode(type7); \
-	size_t type7_len = __builtin_strlen(type7_); \
-	char sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len+type7_len+1]; \
-	__builtin_memcpy(sig, return_, return_len); \
-	sig[return_len] = _C_ID; \
-	sig[return_len+1] = _C_SEL; \
-	__builtin_memcpy(&sig[return_len+2], type1_, type1_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len], type2_, type2_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len], type3_, type3_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len], type4_, type4_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len], type5_, type5_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len], type6_, type6_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len], type7_, type7_len); \
-	sig[return_len+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len+type7_len+2] = '\0';
+	CHDeclareSig_(return_type, type1, type2, type3, type4, type5, type6, type7)
 #define CHDeclareSig8_(return_type, type1, type2, type3, type4, type5, type6, type7, type8) \
-	const char *return_ = @encode(return_type); \
-	size_t return_len = __builtin_strlen(return_); \
-	const char *type1_ = @encode(type1); \
-	size_t type1_len = __builtin_strlen(type1_); \
-	const char *type2_ = @encode(type2); \
-	size_t type2_len = __builtin_strlen(type2_); \
-	const char *type3_ = @encode(type3); \
-	size_t type3_len = __builtin_strlen(type3_); \
-	const char *type4_ = @encode(type4); \
-	size_t type4_len = __builtin_strlen(type4_); \
-	const char *type5_ = @encode(type5); \
-	size_t type5_len = __builtin_strlen(type5_); \
-	const char *type6_ = @encode(type6); \
-	size_t type6_len = __builtin_strlen(type6_); \
-	const char *type7_ = @encode(type7); \
-	size_t type7_len = __builtin_strlen(type7_); \
-	const char *type8_ = @encode(type8); \
-	size_t type8_len = __builtin_strlen(type8_); \
-	char sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len+type7_len+type8_len+1]; \
-	__builtin_memcpy(sig, return_, return_len); \
-	sig[return_len] = _C_ID; \
-	sig[return_len+1] = _C_SEL; \
-	__builtin_memcpy(&sig[return_len+2], type1_, type1_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len], type2_, type2_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len], type3_, type3_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len], type4_, type4_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len], type5_, type5_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len], type6_, type6_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len], type7_, type7_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len+type7_len], type8_, type8_len); \
-	sig[return_len+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len+type7_len+type8_len+2] = '\0';
+	CHDeclareSig_(return_type, type1, type2, type3, type4, type5, type6, type7, type8)
 #define CHDeclareSig9_(return_type, type1, type2, type3, type4, type5, type6, type7, type8, type9) \
-	const char *return_ = @encode(return_type); \
-	size_t return_len = __builtin_strlen(return_); \
-	const char *type1_ = @encode(type1); \
-	size_t type1_len = __builtin_strlen(type1_); \
-	const char *type2_ = @encode(type2); \
-	size_t type2_len = __builtin_strlen(type2_); \
-	const char *type3_ = @encode(type3); \
-	size_t type3_len = __builtin_strlen(type3_); \
-	const char *type4_ = @encode(type4); \
-	size_t type4_len = __builtin_strlen(type4_); \
-	const char *type5_ = @encode(type5); \
-	size_t type5_len = __builtin_strlen(type5_); \
-	const char *type6_ = @encode(type6); \
-	size_t type6_len = __builtin_strlen(type6_); \
-	const char *type7_ = @encode(type7); \
-	size_t type7_len = __builtin_strlen(type7_); \
-	const char *type8_ = @encode(type8); \
-	size_t type8_len = __builtin_strlen(type8_); \
-	const char *type9_ = @encode(type9); \
-	size_t type9_len = __builtin_strlen(type9_); \
-	char sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len+type7_len+type8_len+type9_len+1]; \
-	__builtin_memcpy(sig, return_, return_len); \
-	sig[return_len] = _C_ID; \
-	sig[return_len+1] = _C_SEL; \
-	__builtin_memcpy(&sig[return_len+2], type1_, type1_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len], type2_, type2_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len], type3_, type3_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len], type4_, type4_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len], type5_, type5_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len], type6_, type6_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len], type7_, type7_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len+type7_len], type8_, type8_len); \
-	__builtin_memcpy(&sig[return_len+2+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len+type7_len+type8_len], type9_, type9_len); \
-	sig[return_len+type1_len+type2_len+type3_len+type4_len+type5_len+type6_len+type7_len+type8_len+type9_len+2] = '\0';
-	
+	CHDeclareSig_(return_type, type1, type2, type3, type4, type5, type6, type7, type8, type9)
+#else
+// @encode is an expression rather than a string literal token, so C cannot paste the encodings together at compile time;
+// their lengths are constant, though, so each signature is joined once into static storage sized to fit, on its hook's first registration
+#define CHSigLength_(type) (sizeof(@encode(type)) - 1)
+__attribute__((unused))
+static void CHInitializeSig_(char *sig, const char **encodings)
+{
+	// The first character is written last so that a non-empty signature is always complete
+	if (__atomic_load_n(&sig[0], __ATOMIC_ACQUIRE))
+		return;
+	char first = encodings[0][0];
+	char *cursor = sig + 1;
+	for (const char *c = encodings[0] + 1; *c; c++)
+		*cursor++ = *c;
+	*cursor++ = _C_ID;
+	*cursor++ = _C_SEL;
+	for (size_t i = 1; encodings[i]; i++)
+		for (const char *c = encodings[i]; *c; c++)
+			*cursor++ = *c;
+	*cursor = '\0';
+	__atomic_store_n(&sig[0], first, __ATOMIC_RELEASE);
+}
+#define CHDeclareSig0_(return_type) \
+	static char sig[CHSigLength_(return_type) + 2 + 1]; \
+	CHInitializeSig_(sig, (const char *[]){ @encode(return_type), NULL });
+#define CHDeclareSig1_(return_type, type1) \
+	static char sig[CHSigLength_(return_type) + CHSigLength_(type1) + 2 + 1]; \
+	CHInitializeSig_(sig, (const char *[]){ @encode(return_type), @encode(type1), NULL });
+#define CHDeclareSig2_(return_type, type1, type2) \
+	static char sig[CHSigLength_(return_type) + CHSigLength_(type1) + CHSigLength_(type2) + 2 + 1]; \
+	CHInitializeSig_(sig, (const char *[]){ @encode(return_type), @encode(type1), @encode(type2), NULL });
+#define CHDeclareSig3_(return_type, type1, type2, type3) \
+	static char sig[CHSigLength_(return_type) + CHSigLength_(type1) + CHSigLength_(type2) + CHSigLength_(type3) + 2 + 1]; \
+	CHInitializeSig_(sig, (const char *[]){ @encode(return_type), @encode(type1), @encode(type2), @encode(type3), NULL });
+#define CHDeclareSig4_(return_type, type1, type2, type3, type4) \
+	static char sig[CHSigLength_(return_type) + CHSigLength_(type1) + CHSigLength_(type2) + CHSigLength_(type3) + CHSigLength_(type4) + 2 + 1]; \
+	CHInitializeSig_(sig, (const char *[]){ @encode(return_type), @encode(type1), @encode(type2), @encode(type3), @encode(type4), NULL });
+#define CHDeclareSig5_(return_type, type1, type2, type3, type4, type5) \
+	static char sig[CHSigLength_(return_type) + CHSigLength_(type1) + CHSigLength_(type2) + CHSigLength_(type3) + CHSigLength_(type4) + CHSigLength_(type5) + 2 + 1]; \
+	CHInitializeSig_(sig, (const char *[]){ @encode(return_type), @encode(type1), @encode(type2), @encode(type3), @encode(type4), @encode(type5), NULL });
+#define CHDeclareSig6_(return_type, type1, type2, type3, type4, type5, type6) \
+	static char sig[CHSigLength_(return_type) + CHSigLength_(type1) + CHSigLength_(type2) + CHSigLength_(type3) + CHSigLength_(type4) + CHSigLength_(type5) + CHSigLength_(type6) + 2 + 1]; \
+	CHInitializeSig_(sig, (const char *[]){ @encode(return_type), @encode(type1), @encode(type2), @encode(type3), @encode(type4), @encode(type5), @encode(type6), NULL });
+#define CHDeclareSig7_(return_type, type1, type2, type3, type4, type5, type6, type7) \
+	static char sig[CHSigLength_(return_type) + CHSigLength_(type1) + CHSigLength_(type2) + CHSigLength_(type3) + CHSigLength_(type4) + CHSigLength_(type5) + CHSigLength_(type6) + CHSigLength_(type7) + 2 + 1]; \
+	CHInitializeSig_(sig, (const char *[]){ @encode(return_type), @encode(type1), @encode(type2), @encode(type3), @encode(type4), @encode(type5), @encode(type6), @encode(type7), NULL });
+#define CHDeclareSig8_(return_type, type1, type2, type3, type4, type5, type6, type7, type8) \
+	static char sig[CHSigLength_(return_type) + CHSigLength_(type1) + CHSigLength_(type2) + CHSigLength_(type3) + CHSigLength_(type4) + CHSigLength_(type5) + CHSigLength_(type6) + CHSigLength_(type7) + CHSigLength_(type8) + 2 + 1]; \
+	CHInitializeSig_(sig, (const char *[]){ @encode(return_type), @encode(type1), @encode(type2), @encode(type3), @encode(type4), @encode(type5), @encode(type6), @encode(type7), @encode(type8), NULL });
+#define CHDeclareSig9_(return_type, type1, type2, type3, type4, type5, type6, type7, type8, type9) \
+	static char sig[CHSigLength_(return_type) + CHSigLength_(type1) + CHSigLength_(type2) + CHSigLength_(type3) + CHSigLength_(type4) + CHSigLength_(type5) + CHSigLength_(type6) + CHSigLength_(type7) + CHSigLength_(type8) + CHSigLength_(type9) + 2 + 1]; \
+	CHInitializeSig_(sig, (const char *[]){ @encode(return_type), @encode(type1), @encode(type2), @encode(type3), @encode(type4), @encode(type5), @encode(type6), @encode(type7), @encode(type8), @encode(type9), NULL });
+#endif
+
+// Super IMP Cache (used by the closures of methods that were only inherited before being hooked)
+#ifdef CHCacheSuperIMP
+__attribute__((weak, visibility("hidden"))) unsigned CHSuperCacheGeneration_ = 1;
+#define CHSuperCacheFilling_ (~0u)
+struct CHSuperCache_ {
+	IMP imp_;
+	unsigned generation_; // CHSuperCacheFilling_ while a thread stores imp_
+};
+typedef struct CHSuperCache_ CHSuperCache_;
+__attribute__((unused)) CHInline
+static IMP CHSuperCacheLookup_(CHSuperCache_ *cache, Class superClass, SEL selector)
+{
+	unsigned generation = __atomic_load_n(&CHSuperCacheGeneration_, __ATOMIC_ACQUIRE);
+	unsigned cached = __atomic_load_n(&cache->generation_, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(cached == generation, 1)) {
+		IMP imp = __atomic_load_n(&cache->imp_, __ATOMIC_ACQUIRE);
+		// A refill marks the cache before storing imp_, so an unchanged generation means imp_ was stored along with it
+		if (__builtin_expect(__atomic_load_n(&cache->generation_, __ATOMIC_RELAXED) == generation, 1))
+			return imp;
+	}
+	IMP result = class_getMethodImplementation(superClass, selector);
+	// Only the thread that takes the cache from an older generation refills it; the generation was read before the lookup, so a result that races an invalidation is stored already stale
+	if (cached != CHSuperCacheFilling_ && (int)(generation - cached) > 0 && __atomic_compare_exchange_n(&cache->generation_, &cached, CHSuperCacheFilling_, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&cache->imp_, result, __ATOMIC_RELEASE);
+		__atomic_store_n(&cache->generation_, generation, __ATOMIC_RELEASE);
+	}
+	return result;
+}
+#define CHSuperIMP_(super_class_val, _cmd) \
+	({ static CHSuperCache_ _cache; CHSuperCacheLookup_(&_cache, super_class_val, _cmd); })
+// Call after changing a superclass's methods outside of CaptainHook (swizzling by other libraries, method_setImplementation, etc); the generation is per image, so each image that caches calls it for itself
+#define CHInvalidateSuperCache() \
+	((void)__atomic_add_fetch(&CHSuperCacheGeneration_, 1, __ATOMIC_RELEASE))
+#else
+#define CHSuperIMP_(super_class_val, _cmd) \
+	class_getMethodImplementation(super_class_val, _cmd)
+#define CHInvalidateSuperCache() \
+	CHNothing()
+#endif
+
+// Hook Instrumentation (CHInstrumentHooks counts calls to every replacement method; CHInstrumentHookTiming also measures time spent in the replacement and in CHSuper)
+#ifdef CHInstrumentHooks
+struct CHHookStats {
+	const char *className;
+	const char *selector;
+	uint64_t calls;
+	uint64_t ticks;
+	uint64_t superTicks;
+	struct CHHookStats *next;
+};
+struct CHHookTimingScope_ {
+	uint64_t *ticks;
+	uint64_t startTime;
+};
+__attribute__((weak, visibility("hidden"))) struct CHHookStats *CHHookStatsList_;
+__attribute__((unused))
+static void CHRegisterHookStats_(struct CHHookStats *stats)
+{
+	struct CHHookStats *head = __atomic_load_n(&CHHookStatsList_, __ATOMIC_RELAXED);
+	do {
+		stats->next = head;
+	} while (!__atomic_compare_exchange_n(&CHHookStatsList_, &head, stats, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+// Calls callback with the statistics of every instrumented hook in the image (times are in CHClockTicks units)
+__attribute__((unused))
+static void CHEnumerateHookStats(void (*callback)(const struct CHHookStats *stats, void *context), void *context)
+{
+	for (struct CHHookStats *stats = __atomic_load_n(&CHHookStatsList_, __ATOMIC_ACQUIRE); stats; stats = stats->next)
+		callback(stats, context);
+}
+__attribute__((unused))
+static void CHHookStatsReport()
+{
+	for (struct CHHookStats *stats = __atomic_load_n(&CHHookStatsList_, __ATOMIC_ACQUIRE); stats; stats = stats->next) {
+		uint64_t calls = __atomic_load_n(&stats->calls, __ATOMIC_RELAXED);
+		uint64_t ticks = __atomic_load_n(&stats->ticks, __ATOMIC_RELAXED);
+		uint64_t superTicks = __atomic_load_n(&stats->superTicks, __ATOMIC_RELAXED);
+		CHLog(@"Hook %s %s: %llu calls; %lluns in replacement, %lluns in super", stats->className, stats->selector, (unsigned long long)calls, (unsigned long long)CHClockTicksToNanoseconds(ticks - superTicks), (unsigned long long)CHClockTicksToNanoseconds(superTicks));
+	}
+}
+__attribute__((unused)) CHInline
+static void CHHookTimingScopeEnd_(struct CHHookTimingScope_ *scope)
+{
+	__atomic_add_fetch(scope->ticks, CHClockTicks() - scope->startTime, __ATOMIC_RELAXED);
+}
+#ifdef CHInstrumentHookTiming
+#define CHHookTimingScope_(name, ticks_val) \
+	struct CHHookTimingScope_ name __attribute__((cleanup(CHHookTimingScopeEnd_))) = { &(ticks_val), CHClockTicks() }
+#else
+#define CHHookTimingScope_(name, ticks_val) \
+	CHNothing()
+#endif
+#define CHHookStatsDeclaration_(class_name, name, sel) \
+	static struct CHHookStats $ ## class_name ## _ ## name ## _stats = { #class_name, #sel }; \
+	__attribute__((constructor)) \
+	static void $ ## class_name ## _ ## name ## _statsConstructor() { \
+		CHRegisterHookStats_(&$ ## class_name ## _ ## name ## _stats); \
+	}
+#define CHHookStatsEnter_(class_name, name) \
+	__atomic_add_fetch(&$ ## class_name ## _ ## name ## _stats.calls, 1, __ATOMIC_RELAXED); \
+	CHHookTimingScope_(_hookScope, $ ## class_name ## _ ## name ## _stats.ticks)
+#else
+#define CHHookStatsReport() \
+	CHNothing()
+#define CHHookStatsDeclaration_(class_name, name, sel)
+#define CHHookStatsEnter_(class_name, name) \
+	CHNothing()
+#endif
+
+// Hook Quiescence (counts the threads executing each replacement, so that unhooking can wait until none is left inside it)
+// This is best effort: a thread drops the count just before the replacement's epilogue returns, and one that looked up the old IMP may enter it after the grace period,
+// so the replacement's code must stay mapped even after the wait succeeds
+#ifdef CHHookQuiescence
+#import <sched.h>
+#import <unistd.h>
+#ifndef CHHookQuiescenceGracePeriod
+#define CHHookQuiescenceGracePeriod 1000
+#endif
+#ifndef CHHookQuiescenceTimeout
+#define CHHookQuiescenceTimeout 1000000
+#endif
+__attribute__((unused)) CHInline
+static void CHHookQuiescenceLeave_(unsigned **inflight)
+{
+	__atomic_sub_fetch(*inflight, 1, __ATOMIC_RELEASE);
+}
+// Callers that looked up the old IMP just before it was swapped out but have not yet entered it are covered by the grace period (in microseconds);
+// returns NO if a replacement is still running after CHHookQuiescenceTimeout microseconds, such as one blocked or called recursively by the waiting thread
+__attribute__((unused))
+static BOOL CHHookWaitForQuiescence_(unsigned **counters, size_t count)
+{
+	usleep(CHHookQuiescenceGracePeriod);
+	uint64_t start = CHClockTicks();
+	for (size_t i = 0; i < count; i++)
+		while (__atomic_load_n(counters[i], __ATOMIC_ACQUIRE)) {
+			if (CHClockTicksToNanoseconds(CHClockTicks() - start) >= (uint64_t)CHHookQuiescenceTimeout * 1000)
+				return NO;
+			sched_yield();
+		}
+	return YES;
+}
+#define CHHookQuiescenceDeclaration_(class_name, name) \
+	static unsigned $ ## class_name ## _ ## name ## _inflight;
+#define CHHookQuiescenceCounter_(class_name, name) \
+	&$ ## class_name ## _ ## name ## _inflight
+#define CHHookQuiescenceEnter_(class_name, name) \
+	unsigned *_hookInflight __attribute__((cleanup(CHHookQuiescenceLeave_))) = &$ ## class_name ## _ ## name ## _inflight; \
+	__atomic_add_fetch(_hookInflight, 1, __ATOMIC_ACQUIRE)
+#else
+#define CHHookQuiescenceDeclaration_(class_name, name)
+#define CHHookQuiescenceCounter_(class_name, name) \
+	NULL
+#define CHHookQuiescenceEnter_(class_name, name) \
+	CHNothing()
+#endif
+
+// Tracing (a flight recorder: every replacement logs its entry and exit into a per-thread ring of a memory-mapped file)
+//	CHTraceStart("/tmp/MyTweak.chtrace"); // after a hang or crash, decode the file with Tools/chtrace-decode.c
+// The kernel writes the mapped pages back even if the process dies, and recording a call takes no locks and allocates nothing.
+// A thread claims one of CHTraceRegionCount rings of CHTraceRegionRecords records the first time it runs a hook and returns it when it exits, for the next
+// thread to reuse; while every ring is taken, further threads are not traced
+#ifdef CHEnableTracing
+#import <fcntl.h>
+#import <pthread.h>
+#import <stdio.h>
+#import <sys/mman.h>
+#import <unistd.h>
+#ifndef CHTraceRegionCount
+#define CHTraceRegionCount 64
+#endif
+#ifndef CHTraceRegionRecords
+#define CHTraceRegionRecords 4096
+#endif
+_Static_assert((CHTraceRegionRecords & (CHTraceRegionRecords - 1)) == 0, "CHTraceRegionRecords must be a power of two");
+#ifndef CHTraceNameCapacity
+#define CHTraceNameCapacity 1024
+#endif
+#define CHTraceNameLength 128
+#define CHTraceMagic 0x52544843 // "CHTR"
+#define CHTraceVersion 1
+// The layout is mirrored by Tools/chtrace-decode.c; change CHTraceVersion along with it
+struct CHTraceHeader_ {
+	uint32_t magic_;
+	uint32_t version_;
+	uint32_t regionCount_;
+	uint32_t regionRecords_;
+	uint32_t nameCapacity_;
+	uint32_t nameLength_;
+	uint32_t nameCount_;
+	uint32_t regionsClaimed_;
+	uint64_t clockScale_; // nanoseconds per 2^32 ticks
+	uint64_t startTicks_;
+	uint64_t reserved_[2];
+};
+struct CHTraceRecord_ {
+	uint64_t ticks_;
+	uint32_t hook_;
+	uint32_t event_; // 0 on entry, 1 on exit
+};
+struct CHTraceRegion_ {
+	uint64_t thread_;
+	uint64_t position_;
+	struct CHTraceRecord_ records_[CHTraceRegionRecords];
+};
+#define CHTraceHookPending_ UINT32_MAX
+#define CHTraceRegionExhausted_ ((struct CHTraceRegion_ *)1)
+#define CHTraceRegionReleased_ ((struct CHTraceRegion_ *)2)
+__attribute__((weak, visibility("hidden"))) struct CHTraceHeader_ *CHTraceFile_;
+__attribute__((weak, visibility("hidden"))) __thread struct CHTraceRegion_ *CHTraceThreadRegion_;
+// Regions of exited threads, reused before claiming fresh ones
+__attribute__((weak, visibility("hidden"))) uint32_t CHTraceFreeRegions_[CHTraceRegionCount];
+__attribute__((weak, visibility("hidden"))) uint32_t CHTraceFreeCount_;
+__attribute__((weak, visibility("hidden"))) pthread_mutex_t CHTraceRegionLock_ = PTHREAD_MUTEX_INITIALIZER;
+__attribute__((weak, visibility("hidden"))) pthread_key_t CHTraceRegionKey_;
+__attribute__((weak, visibility("hidden"))) pthread_once_t CHTraceRegionKeyOnce_ = PTHREAD_ONCE_INIT;
+__attribute__((unused)) CHInline
+static char *CHTraceNames_(struct CHTraceHeader_ *file)
+{
+	return (char *)(file + 1);
+}
+__attribute__((unused)) CHInline
+static struct CHTraceRegion_ *CHTraceRegions_(struct CHTraceHeader_ *file)
+{
+	return (struct CHTraceRegion_ *)(CHTraceNames_(file) + (size_t)CHTraceNameCapacity * CHTraceNameLength);
+}
+// Maps path (replacing any previous contents) and starts recording; returns NO if the file cannot be mapped
+__attribute__((unused))
+static BOOL CHTraceStart(const char *path)
+{
+	if (__atomic_load_n(&CHTraceFile_, __ATOMIC_ACQUIRE))
+		return YES;
+	size_t size = sizeof(struct CHTraceHeader_) + (size_t)CHTraceNameCapacity * CHTraceNameLength + (size_t)CHTraceRegionCount * sizeof(struct CHTraceRegion_);
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return NO;
+	if (ftruncate(fd, (off_t)size) != 0) {
+		close(fd);
+		return NO;
+	}
+	void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return NO;
+	struct CHTraceHeader_ *file = (struct CHTraceHeader_ *)mapping;
+	file->magic_ = CHTraceMagic;
+	file->version_ = CHTraceVersion;
+	file->regionCount_ = CHTraceRegionCount;
+	file->regionRecords_ = CHTraceRegionRecords;
+	file->nameCapacity_ = CHTraceNameCapacity;
+	file->nameLength_ = CHTraceNameLength;
+	file->clockScale_ = CHClockTicksToNanoseconds(1ULL << 32);
+	file->startTicks_ = CHClockTicks();
+	struct CHTraceHeader_ *expected = NULL;
+	if (!__atomic_compare_exchange_n(&CHTraceFile_, &expected, file, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+		munmap(mapping, size);
+	return YES;
+}
+__attribute__((unused))
+static void CHTraceReleaseRegion_(void *value)
+{
+	pthread_mutex_lock(&CHTraceRegionLock_);
+	CHTraceFreeRegions_[CHTraceFreeCount_] = (uint32_t)((uintptr_t)value - 1);
+	__atomic_store_n(&CHTraceFreeCount_, CHTraceFreeCount_ + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&CHTraceRegionLock_);
+	// Hooks run by later destructors of this thread are not traced, rather than claiming a region that nothing would release
+	CHTraceThreadRegion_ = CHTraceRegionReleased_;
+}
+__attribute__((unused))
+static void CHTraceCreateRegionKey_()
+{
+	pthread_key_create(&CHTraceRegionKey_, CHTraceReleaseRegion_);
+}
+// Returns NULL when the thread is not traced; threads that found every region taken check again once another thread has exited
+__attribute__((unused))
+static struct CHTraceRegion_ *CHTraceClaimRegion_(struct CHTraceHeader_ *file, struct CHTraceRegion_ *current)
+{
+	if (current == CHTraceRegionReleased_ || (current == CHTraceRegionExhausted_ && !__atomic_load_n(&CHTraceFreeCount_, __ATOMIC_RELAXED)))
+		return NULL;
+	pthread_once(&CHTraceRegionKeyOnce_, CHTraceCreateRegionKey_);
+	pthread_mutex_lock(&CHTraceRegionLock_);
+	uint32_t index;
+	if (CHTraceFreeCount_) {
+		index = CHTraceFreeRegions_[CHTraceFreeCount_ - 1];
+		__atomic_store_n(&CHTraceFreeCount_, CHTraceFreeCount_ - 1, __ATOMIC_RELAXED);
+	} else if (file->regionsClaimed_ < CHTraceRegionCount) {
+		// The header keeps the number of regions ever used, so that the decoder knows how far to look
+		index = file->regionsClaimed_;
+		__atomic_store_n(&file->regionsClaimed_, index + 1, __ATOMIC_RELAXED);
+	} else {
+		pthread_mutex_unlock(&CHTraceRegionLock_);
+		CHTraceThreadRegion_ = CHTraceRegionExhausted_;
+		return NULL;
+	}
+	pthread_mutex_unlock(&CHTraceRegionLock_);
+	struct CHTraceRegion_ *region = &CHTraceRegions_(file)[index];
+	// A reused region starts over; the records of the thread that exited are dropped
+	__atomic_store_n(&region->position_, 0, __ATOMIC_RELEASE);
+#ifdef __APPLE__
+	pthread_threadid_np(NULL, &region->thread_);
+#else
+	region->thread_ = (uint64_t)(uintptr_t)pthread_self();
+#endif
+	pthread_setspecific(CHTraceRegionKey_, (void *)(uintptr_t)(index + 1));
+	return CHTraceThreadRegion_ = region;
+}
+// Hooks are numbered the first time they run, so the file only names the hooks that were actually traced; the thread that claims the hook takes
+// its name slot, and threads racing it wait for the number instead of taking slots of their own
+__attribute__((unused))
+static uint32_t CHTraceRegisterHook_(struct CHTraceHeader_ *file, uint32_t *hook, const char *className, const char *selector)
+{
+	uint32_t expected = 0;
+	if (!__atomic_compare_exchange_n(hook, &expected, CHTraceHookPending_, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		while (expected == CHTraceHookPending_)
+			expected = __atomic_load_n(hook, __ATOMIC_ACQUIRE);
+		return expected;
+	}
+	uint32_t id = __atomic_add_fetch(&file->nameCount_, 1, __ATOMIC_RELAXED);
+	if (id <= CHTraceNameCapacity)
+		snprintf(&CHTraceNames_(file)[(size_t)(id - 1) * CHTraceNameLength], CHTraceNameLength, "%s %s", className, selector);
+	__atomic_store_n(hook, id, __ATOMIC_RELEASE);
+	return id;
+}
+__attribute__((unused)) CHInline
+static void CHTraceRecord_(uint32_t hook, uint32_t event)
+{
+	struct CHTraceRegion_ *region = CHTraceThreadRegion_;
+	if (__builtin_expect((uintptr_t)region <= (uintptr_t)CHTraceRegionReleased_, 0)) {
+		region = CHTraceClaimRegion_(__atomic_load_n(&CHTraceFile_, __ATOMIC_ACQUIRE), region);
+		if (!region)
+			return;
+	}
+	uint64_t position = region->position_;
+	struct CHTraceRecord_ *record = &region->records_[position & (CHTraceRegionRecords - 1)];
+	record->ticks_ = CHClockTicks();
+	record->hook_ = hook;
+	record->event_ = event;
+	// The decoder trusts the records below position
+	__atomic_store_n(&region->position_, position + 1, __ATOMIC_RELEASE);
+}
+__attribute__((unused)) CHInline
+static uint32_t *CHTraceEnter_(uint32_t *hook, const char *className, const char *selector)
+{
+	struct CHTraceHeader_ *file = __atomic_load_n(&CHTraceFile_, __ATOMIC_ACQUIRE);
+	if (!file)
+		return NULL;
+	uint32_t id = __atomic_load_n(hook, __ATOMIC_RELAXED);
+	if (__builtin_expect(!id || id == CHTraceHookPending_, 0))
+		id = CHTraceRegisterHook_(file, hook, className, selector);
+	CHTraceRecord_(id, 0);
+	return hook;
+}
+__attribute__((unused)) CHInline
+static void CHTraceExit_(uint32_t **hook)
+{
+	if (*hook)
+		CHTraceRecord_(__atomic_load_n(*hook, __ATOMIC_RELAXED), 1);
+}
+#define CHTraceEnterHook_(class_name, name, sel) \
+	static uint32_t $ ## class_name ## _ ## name ## _traceId; \
+	uint32_t *_traceHook __attribute__((unused, cleanup(CHTraceExit_))) = CHTraceEnter_(&$ ## class_name ## _ ## name ## _traceId, #class_name, #sel)
+#else
+#define CHTraceEnterHook_(class_name, name, sel) \
+	CHNothing()
+#endif
+
+// Replacements are wrapped in a function that does the bookkeeping of the enabled instrumentation before entering the body
+#if defined(CHInstrumentHooks) || defined(CHHookQuiescence) || defined(CHEnableTracing)
+#define CHMethodImplementation_(return_type, class_type, class_name, name, sel, supercall, args...) \
+	CHHookStatsDeclaration_(class_name, name, sel) \
+	static return_type $ ## class_name ## _ ## name ## _body(class_type self, SEL _cmd, ##args); \
+	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args) { \
+		CHHookQuiescenceEnter_(class_name, name); \
+		CHTraceEnterHook_(class_name, name, sel); \
+		CHHookStatsEnter_(class_name, name); \
+		return $ ## class_name ## _ ## name ## _body supercall; \
+	} \
+	static return_type $ ## class_name ## _ ## name ## _body(class_type self, SEL _cmd, ##args)
+#else
+#define CHMethodImplementation_(return_type, class_type, class_name, name, sel, supercall, args...) \
+	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args)
+#endif
+
+// Image sections (records placed here by the linker are walked by a single constructor per image)
+#if defined(__APPLE__)
+#import <mach-o/getsect.h>
+#ifdef __LP64__
+extern const struct mach_header_64 __dso_handle;
+#else
+extern const struct mach_header __dso_handle;
+#endif
+#define CHImageSection_(name) __attribute__((used, section("__DATA,__" #name)))
+#elif defined(__ELF__)
+#define CHImageSection_(name) __attribute__((used, section(#name)))
+#endif
+
+// Selector Table (registers the selectors of all hooks in an image at once instead of at each registration and super call)
+#if defined(CHSelectorTable) && defined(CHImageSection_)
+struct CHSelectorTableEntry_ {
+	const char *name_;
+	SEL *slot_;
+};
+typedef struct CHSelectorTableEntry_ CHSelectorTableEntry_;
+#ifndef __APPLE__
+extern CHSelectorTableEntry_ __start_chselectors[] __attribute__((weak, visibility("hidden")));
+extern CHSelectorTableEntry_ __stop_chselectors[] __attribute__((weak, visibility("hidden")));
+#endif
+__attribute__((weak, visibility("hidden"))) int CHSelectorTableRegistered_;
+__attribute__((weak, visibility("hidden"), constructor))
+void CHRegisterSelectorTable_(void)
+{
+	// Every translation unit contributes this constructor, but the linker keeps only one copy
+	if (CHSelectorTableRegistered_)
+		return;
+	CHSelectorTableRegistered_ = 1;
+#ifdef __APPLE__
+	unsigned long size = 0;
+	CHSelectorTableEntry_ *entries = (CHSelectorTableEntry_ *)getsectiondata(&__dso_handle, "__DATA", "__chselectors", &size);
+	size_t count = size / sizeof(CHSelectorTableEntry_);
+#else
+	CHSelectorTableEntry_ *entries = __start_chselectors;
+	size_t count = entries ? (size_t)(__stop_chselectors - __start_chselectors) : 0;
+#endif
+	for (size_t i = 0; i < count; i++)
+		if (!__atomic_load_n(entries[i].slot_, __ATOMIC_RELAXED))
+			__atomic_store_n(entries[i].slot_, sel_registerName(entries[i].name_), __ATOMIC_RELEASE);
+}
+// Hooks registered from constructors that run before the table is registered fill their slot themselves
+static inline SEL CHSelectorTableLookup_(const CHSelectorTableEntry_ *entry)
+{
+	SEL selector = __atomic_load_n(entry->slot_, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(!selector, 0)) {
+		selector = sel_registerName(entry->name_);
+		__atomic_store_n(entry->slot_, selector, __ATOMIC_RELEASE);
+	}
+	return selector;
+}
+#define CHMethodSelectorSlot_(class_name, name, sel) \
+	static SEL $ ## class_name ## _ ## name ## _selector; \
+	static CHSelectorTableEntry_ $ ## class_name ## _ ## name ## _selectorEntry CHImageSection_(chselectors) = { #sel, &$ ## class_name ## _ ## name ## _selector };
+#define CHMethodSelector_(class_name, name, sel) \
+	CHSelectorTableLookup_(&$ ## class_name ## _ ## name ## _selectorEntry)
+#else
+#define CHMethodSelectorSlot_(class_name, name, sel)
+#define CHMethodSelector_(class_name, name, sel) \
+	@selector(sel)
+#endif
+
+// Publishing super pointers (with CHThreadSafeHooks, a thread calling a replacement while it is being installed always finds a valid super IMP)
+#ifdef CHThreadSafeHooks
+#define CHPublishSuper_(super_val, value) \
+	__atomic_store_n(&(super_val), (__typeof__(super_val))(value), __ATOMIC_RELEASE)
+#define CHReadSuper_(super_val) \
+	__atomic_load_n(&(super_val), __ATOMIC_ACQUIRE)
+// The super pointer is published before the swap; if another thread replaced the method in between, the IMP the swap actually displaced wins
+#define CHReplaceImplementation_(method, replacement, super_val) do { \
+	IMP _previous = method_setImplementation(method, replacement); \
+	if (_previous != (IMP)(replacement) && _previous != (IMP)(super_val)) \
+		CHPublishSuper_(super_val, _previous); \
+} while (0)
+#else
+#define CHPublishSuper_(super_val, value) \
+	((super_val) = (__typeof__(super_val))(value))
+#define CHReadSuper_(super_val) \
+	(super_val)
+#define CHReplaceImplementation_(method, replacement, super_val) \
+	method_setImplementation(method, replacement)
+#endif
+
+// What a hook's registration did to its class (see CHUnhook)
+enum {
+	CHHookStateInactive = 0,
+	CHHookStateReplaced = 1, // the class implemented the method; the original is saved in the hook's super pointer
+	CHHookStateAdded = 2, // the class inherited the method; the replacement was added and super calls go through the closure
+	CHHookStateNew = 3, // no class implemented the method; it was added and cannot be taken away again
+};
+
+// Describes a hook for CHBatchHook (see Batched Hook Registration below)
+#define CHMethodEntry_(class_name, class_val, name, sel, super_val, closure_val) \
+	CHMethodSelectorSlot_(class_name, name, sel) \
+	CHHookQuiescenceDeclaration_(class_name, name) \
+	static int $ ## class_name ## _ ## name ## _state; \
+	static IMP $ ## class_name ## _ ## name ## _current; \
+	static inline void $ ## class_name ## _ ## name ## _register(); \
+	__attribute__((unused)) \
+	static inline void $ ## class_name ## _ ## name ## _entry(CHHookEntry_ *entry) { \
+		entry->class_ = class_val; \
+		entry->selector_ = CHMethodSelector_(class_name, name, sel); \
+		entry->replacement_ = (IMP)&$ ## class_name ## _ ## name ## _method; \
+		entry->super_ = (IMP *)super_val; \
+		entry->closure_ = (IMP)closure_val; \
+		entry->register_ = &$ ## class_name ## _ ## name ## _register; \
+		entry->state_ = &$ ## class_name ## _ ## name ## _state; \
+		entry->current_ = &$ ## class_name ## _ ## name ## _current; \
+		entry->inflight_ = CHHookQuiescenceCounter_(class_name, name); \
+	}
+
 #ifdef CHUseSubstrate
 #import <substrate.h>
 #define CHMethod_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, args...) \
 	static return_type (*$ ## class_name ## _ ## name ## _super)(class_type self, SEL _cmd, ##args); \
 	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args); \
+	CHMethodEntry_(class_name, class_val, name, sel, &$ ## class_name ## _ ## name ## _super, NULL) \
 	__attribute__((always_inline)) \
 	static inline void $ ## class_name ## _ ## name ## _register() { \
+		SEL selector = CHMethodSelector_(class_name, name, sel); \
 		if (class_val) { \
-			MSHookMessageEx(class_val, @selector(sel), (IMP)&$ ## class_name ## _ ## name ## _method, (IMP *)&$ ## class_name ## _ ## name ## _super); \
-			if (!$ ## class_name ## _ ## name ## _super) { \
+			MSHookMessageEx(class_val, selector, (IMP)&$ ## class_name ## _ ## name ## _method, (IMP *)&$ ## class_name ## _ ## name ## _super); \
+			if ($ ## class_name ## _ ## name ## _super) { \
+				$ ## class_name ## _ ## name ## _state = CHHookStateReplaced; \
+			} else { \
 				sigdef; \
-				class_addMethod(class_val, @selector(sel), (IMP)&$ ## class_name ## _ ## name ## _method, sig); \
+				if (class_addMethod(class_val, selector, (IMP)&$ ## class_name ## _ ## name ## _method, sig)) \
+					$ ## class_name ## _ ## name ## _state = CHHookStateNew; \
 			} \
 		} \
 	} \
-	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args)
+	CHMethodImplementation_(return_type, class_type, class_name, name, sel, supercall, ##args)
 #define CHMethod_new_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, args...) \
 	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args); \
+	CHMethodEntry_(class_name, class_val, name, sel, NULL, NULL) \
 	__attribute__((always_inline)) \
 	static inline void $ ## class_name ## _ ## name ## _register() { \
+		SEL selector = CHMethodSelector_(class_name, name, sel); \
 		sigdef; \
-		class_addMethod(class_val, @selector(sel), (IMP)&$ ## class_name ## _ ## name ## _method, sig); \
+		if (class_addMethod(class_val, selector, (IMP)&$ ## class_name ## _ ## name ## _method, sig)) \
+			$ ## class_name ## _ ## name ## _state = CHHookStateNew; \
 	} \
-	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args)
+	CHMethodImplementation_(return_type, class_type, class_name, name, sel, supercall, ##args)
 #define CHMethod_super_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, args...) \
 	static return_type (*$ ## class_name ## _ ## name ## _super)(class_type self, SEL _cmd, ##args); \
 	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args); \
+	CHMethodEntry_(class_name, class_val, name, sel, &$ ## class_name ## _ ## name ## _super, NULL) \
 	__attribute__((always_inline)) \
 	static inline void $ ## class_name ## _ ## name ## _register() { \
+		SEL selector = CHMethodSelector_(class_name, name, sel); \
 		if (class_val) { \
-			MSHookMessageEx(class_val, @selector(sel), (IMP)&$ ## class_name ## _ ## name ## _method, (IMP *)&$ ## class_name ## _ ## name ## _super); \
+			MSHookMessageEx(class_val, selector, (IMP)&$ ## class_name ## _ ## name ## _method, (IMP *)&$ ## class_name ## _ ## name ## _super); \
+			if ($ ## class_name ## _ ## name ## _super) \
+				$ ## class_name ## _ ## name ## _state = CHHookStateReplaced; \
 		} \
 	} \
-	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args)
+	CHMethodImplementation_(return_type, class_type, class_name, name, sel, supercall, ##args)
 #define CHMethod_self_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, args...) \
 	static return_type (*$ ## class_name ## _ ## name ## _super)(class_type self, SEL _cmd, ##args); \
 	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args); \
+	CHMethodEntry_(class_name, class_val, name, sel, &$ ## class_name ## _ ## name ## _super, NULL) \
 	__attribute__((always_inline)) \
 	static inline void $ ## class_name ## _ ## name ## _register() { \
+		SEL selector = CHMethodSelector_(class_name, name, sel); \
 		if (class_val) { \
-			MSHookMessageEx(class_val, @selector(sel), (IMP)&$ ## class_name ## _ ## name ## _method, (IMP *)&$ ## class_name ## _ ## name ## _super); \
+			MSHookMessageEx(class_val, selector, (IMP)&$ ## class_name ## _ ## name ## _method, (IMP *)&$ ## class_name ## _ ## name ## _super); \
+			if ($ ## class_name ## _ ## name ## _super) \
+				$ ## class_name ## _ ## name ## _state = CHHookStateReplaced; \
 		} \
 	} \
-	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args)
+	CHMethodImplementation_(return_type, class_type, class_name, name, sel, supercall, ##args)
 #else
 #define CHMethod_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, args...) \
 	static return_type (*$ ## class_name ## _ ## name ## _super)(class_type self, SEL _cmd, ##args); \
 	static return_type $ ## class_name ## _ ## name ## _closure(class_type self, SEL _cmd, ##args) { \
 		typedef return_type (*supType)(class_type, SEL, ## args); \
-		supType supFn = (supType)class_getMethodImplementation(super_class_val, _cmd); \
+		supType supFn = (supType)CHSuperIMP_(super_class_val, _cmd); \
 		return supFn supercall; \
 	} \
 	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args); \
+	CHMethodEntry_(class_name, class_val, name, sel, &$ ## class_name ## _ ## name ## _super, &$ ## class_name ## _ ## name ## _closure) \
 	__attribute__((always_inline)) \
 	static inline void $ ## class_name ## _ ## name ## _register() { \
-		Method method = class_getInstanceMethod(class_val, @selector(sel)); \
+		SEL selector = CHMethodSelector_(class_name, name, sel); \
+		Method method = class_getInstanceMethod(class_val, selector); \
 		if (method) { \
-			$ ## class_name ## _ ## name ## _super = (__typeof__($ ## class_name ## _ ## name ## _super))method_getImplementation(method); \
-			if (class_addMethod(class_val, @selector(sel), (IMP)&$ ## class_name ## _ ## name ## _method, method_getTypeEncoding(method))) { \
-				$ ## class_name ## _ ## name ## _super = &$ ## class_name ## _ ## name ## _closure; \
+			CHPublishSuper_($ ## class_name ## _ ## name ## _super, method_getImplementation(method)); \
+			if (class_addMethod(class_val, selector, (IMP)&$ ## class_name ## _ ## name ## _method, method_getTypeEncoding(method))) { \
+				CHPublishSuper_($ ## class_name ## _ ## name ## _super, &$ ## class_name ## _ ## name ## _closure); \
+				$ ## class_name ## _ ## name ## _state = CHHookStateAdded; \
 			} else { \
-				method_setImplementation(method, (IMP)&$ ## class_name ## _ ## name ## _method); \
+				CHReplaceImplementation_(method, (IMP)&$ ## class_name ## _ ## name ## _method, $ ## class_name ## _ ## name ## _super); \
+				$ ## class_name ## _ ## name ## _state = CHHookStateReplaced; \
 			} \
 		} else { \
 			sigdef; \
-			class_addMethod(class_val, @selector(sel), (IMP)&$ ## class_name ## _ ## name ## _method, sig); \
+			if (class_addMethod(class_val, selector, (IMP)&$ ## class_name ## _ ## name ## _method, sig)) \
+				$ ## class_name ## _ ## name ## _state = CHHookStateNew; \
 		} \
+		CHInvalidateSuperCache(); \
 	} \
-	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args)
+	CHMethodImplementation_(return_type, class_type, class_name, name, sel, supercall, ##args)
 #define CHMethod_new_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, args...) \
 	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args); \
+	CHMethodEntry_(class_name, class_val, name, sel, NULL, NULL) \
 	__attribute__((always_inline)) \
 	static inline void $ ## class_name ## _ ## name ## _register() { \
+		SEL selector = CHMethodSelector_(class_name, name, sel); \
 		sigdef; \
-		class_addMethod(class_val, @selector(sel), (IMP)&$ ## class_name ## _ ## name ## _method, sig); \
+		if (class_addMethod(class_val, selector, (IMP)&$ ## class_name ## _ ## name ## _method, sig)) \
+			$ ## class_name ## _ ## name ## _state = CHHookStateNew; \
+		CHInvalidateSuperCache(); \
 	} \
-	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args)
+	CHMethodImplementation_(return_type, class_type, class_name, name, sel, supercall, ##args)
 #define CHMethod_super_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, args...) \
 	static return_type (*$ ## class_name ## _ ## name ## _super)(class_type self, SEL _cmd, ##args); \
 	static return_type $ ## class_name ## _ ## name ## _closure(class_type self, SEL _cmd, ##args) { \
 		typedef return_type (*supType)(class_type, SEL, ## args); \
-		supType supFn = (supType)class_getMethodImplementation(super_class_val, _cmd); \
+		supType supFn = (supType)CHSuperIMP_(super_class_val, _cmd); \
 		return supFn supercall; \
 	} \
 	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args); \
+	CHMethodEntry_(class_name, class_val, name, sel, &$ ## class_name ## _ ## name ## _super, &$ ## class_name ## _ ## name ## _closure) \
 	__attribute__((always_inline)) \
 	static inline void $ ## class_name ## _ ## name ## _register() { \
-		Method method = class_getInstanceMethod(class_val, @selector(sel)); \
+		SEL selector = CHMethodSelector_(class_name, name, sel); \
+		Method method = class_getInstanceMethod(class_val, selector); \
 		if (method) { \
-			$ ## class_name ## _ ## name ## _super = (__typeof__($ ## class_name ## _ ## name ## _super))method_getImplementation(method); \
-			if (class_addMethod(class_val, @selector(sel), (IMP)&$ ## class_name ## _ ## name ## _method, method_getTypeEncoding(method))) { \
-				$ ## class_name ## _ ## name ## _super = &$ ## class_name ## _ ## name ## _closure; \
+			CHPublishSuper_($ ## class_name ## _ ## name ## _super, method_getImplementation(method)); \
+			if (class_addMethod(class_val, selector, (IMP)&$ ## class_name ## _ ## name ## _method, method_getTypeEncoding(method))) { \
+				CHPublishSuper_($ ## class_name ## _ ## name ## _super, &$ ## class_name ## _ ## name ## _closure); \
+				$ ## class_name ## _ ## name ## _state = CHHookStateAdded; \
 			} else { \
-				method_setImplementation(method, (IMP)&$ ## class_name ## _ ## name ## _method); \
+				CHReplaceImplementation_(method, (IMP)&$ ## class_name ## _ ## name ## _method, $ ## class_name ## _ ## name ## _super); \
+				$ ## class_name ## _ ## name ## _state = CHHookStateReplaced; \
 			} \
 		} \
+		CHInvalidateSuperCache(); \
 	} \
-	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args)
+	CHMethodImplementation_(return_type, class_type, class_name, name, sel, supercall, ##args)
 #define CHMethod_self_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, args...) \
 	static return_type (*$ ## class_name ## _ ## name ## _super)(class_type self, SEL _cmd, ##args); \
 	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args); \
+	CHMethodEntry_(class_name, class_val, name, sel, &$ ## class_name ## _ ## name ## _super, NULL) \
 	__attribute__((always_inline)) \
 	static inline void $ ## class_name ## _ ## name ## _register() { \
-		Method method = class_getInstanceMethod(class_val, @selector(sel)); \
+		SEL selector = CHMethodSelector_(class_name, name, sel); \
+		Method method = class_getInstanceMethod(class_val, selector); \
 		if (method) { \
-			$ ## class_name ## _ ## name ## _super = (__typeof__($ ## class_name ## _ ## name ## _super))method_getImplementation(method); \
-			method_setImplementation(method, (IMP)&$ ## class_name ## _ ## name ## _method); \
+			CHPublishSuper_($ ## class_name ## _ ## name ## _super, method_getImplementation(method)); \
+			CHReplaceImplementation_(method, (IMP)&$ ## class_name ## _ ## name ## _method, $ ## class_name ## _ ## name ## _super); \
+			$ ## class_name ## _ ## name ## _state = CHHookStateReplaced; \
 		} \
+		CHInvalidateSuperCache(); \
 	} \
-	static return_type $ ## class_name ## _ ## name ## _method(class_type self, SEL _cmd, ##args)
+	CHMethodImplementation_(return_type, class_type, class_name, name, sel, supercall, ##args)
+#endif
+
+// Memoizing methods (CHOptimizedMethod(count, memo, ...) caches the results of side-effect-free getters per thread)
+//	CHOptimizedMethod(1, memo, CGFloat, UIFont, widthOfString, NSString *, string) {
+//		return CHSuper(1, UIFont, widthOfString, string);
+//	}
+//	CHMemoInvalidate(1, UIFont, widthOfString); // forgets the cached results of one hook on every thread
+//	CHMemoInvalidateAll();                      // forgets the cached results of every memoizing hook
+//	{ CHMemoScope(); [self layoutRows]; }        // results the thread caches inside the block are forgotten when it is entered and left
+// The body runs only when the receiver and the bytes of the arguments miss in the calling thread's last CHMemoCacheSize results.
+// Only use it for methods returning non-object values: cached values are neither retained nor compared by anything but their bytes.
+// The receiver is keyed by its address, so an object allocated where a freed one lived sees the freed one's results; call CHMemoInvalidate when
+// receivers can be deallocated, or only look results up inside a CHMemoScope that every receiver outlives. Struct arguments are compared
+// including their padding, whose bytes are unspecified, so equal structs can miss.
+#ifndef CHMemoCacheSize
+#define CHMemoCacheSize 8
+#endif
+#ifndef CHMemoKeyLength
+#define CHMemoKeyLength 64
 #endif
+__attribute__((weak, visibility("hidden"))) unsigned CHMemoGeneration_ = 1;
+__attribute__((weak, visibility("hidden"))) __thread unsigned CHMemoScopeSerial_;
+__attribute__((unused)) CHInline
+static void CHMemoScopeEnd_(unsigned *serial)
+{
+	CHMemoScopeSerial_++;
+}
+#define CHMemoScope() \
+	unsigned CHConcat(_memoScope, __LINE__) __attribute__((unused, cleanup(CHMemoScopeEnd_))) = ++CHMemoScopeSerial_
+struct CHMemoKey_ {
+	size_t length_;
+	unsigned char bytes_[CHMemoKeyLength];
+};
+typedef struct CHMemoKey_ CHMemoKey_;
+__attribute__((unused)) CHInline
+static void CHMemoKeyAppend_(CHMemoKey_ *key, const void *bytes, size_t length)
+{
+	// Keys that do not fit are still measured, so that the caller can skip the cache
+	if (key->length_ + length <= CHMemoKeyLength)
+		__builtin_memcpy(&key->bytes_[key->length_], bytes, length);
+	key->length_ += length;
+}
+#define CHMemoKeyAppend1_(key, value) \
+	CHMemoKeyAppend_(key, &(value), sizeof(value))
+#define CHMemoKeyAppend2_(key, value, values...) \
+	CHMemoKeyAppend1_(key, value); CHMemoKeyAppend1_(key, values)
+#define CHMemoKeyAppend3_(key, value, values...) \
+	CHMemoKeyAppend1_(key, value); CHMemoKeyAppend2_(key, values)
+#define CHMemoKeyAppend4_(key, value, values...) \
+	CHMemoKeyAppend1_(key, value); CHMemoKeyAppend3_(key, values)
+#define CHMemoKeyAppend5_(key, value, values...) \
+	CHMemoKeyAppend1_(key, value); CHMemoKeyAppend4_(key, values)
+#define CHMemoKeyAppend6_(key, value, values...) \
+	CHMemoKeyAppend1_(key, value); CHMemoKeyAppend5_(key, values)
+#define CHMemoKeyAppend7_(key, value, values...) \
+	CHMemoKeyAppend1_(key, value); CHMemoKeyAppend6_(key, values)
+#define CHMemoKeyAppend8_(key, value, values...) \
+	CHMemoKeyAppend1_(key, value); CHMemoKeyAppend7_(key, values)
+#define CHMemoKeyAppend9_(key, value, values...) \
+	CHMemoKeyAppend1_(key, value); CHMemoKeyAppend8_(key, values)
+#define CHMemoKeyAppend10_(key, value, values...) \
+	CHMemoKeyAppend1_(key, value); CHMemoKeyAppend9_(key, values)
+#define CHMemoKeyAppend11_(key, value, values...) \
+	CHMemoKeyAppend1_(key, value); CHMemoKeyAppend10_(key, values)
+#define CHMemoKeyCount_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, count, values...) count
+#define CHMemoKeyAppendAll_(key, values...) \
+	CHMemoKeyCount_(values, CHMemoKeyAppend11_, CHMemoKeyAppend10_, CHMemoKeyAppend9_, CHMemoKeyAppend8_, CHMemoKeyAppend7_, CHMemoKeyAppend6_, CHMemoKeyAppend5_, CHMemoKeyAppend4_, CHMemoKeyAppend3_, CHMemoKeyAppend2_, CHMemoKeyAppend1_)(key, values)
+#define CHMemoUnparenthesize_(values...) values
+#define CHMemoKeyAppendCall_(key, values...) \
+	CHMemoKeyAppendAll_(key, values)
+#define CHMethod_memo_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, args...) \
+	static unsigned $ ## class_name ## _ ## name ## _memoGeneration = 1; \
+	static return_type $ ## class_name ## _ ## name ## _memoized(class_type self, SEL _cmd, ##args); \
+	CHMethod_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, ##args) { \
+		static __thread struct { \
+			unsigned next_; \
+			struct { \
+				unsigned generation_; \
+				unsigned globalGeneration_; \
+				unsigned scope_; \
+				CHMemoKey_ key_; \
+				return_type value_; \
+			} entries_[CHMemoCacheSize]; \
+		} _memoCache; \
+		CHMemoKey_ _memoKey; \
+		_memoKey.length_ = 0; \
+		CHMemoKeyAppendCall_(&_memoKey, CHMemoUnparenthesize_ supercall); \
+		if (_memoKey.length_ > CHMemoKeyLength) \
+			return $ ## class_name ## _ ## name ## _memoized supercall; \
+		unsigned _memoGeneration = __atomic_load_n(&$ ## class_name ## _ ## name ## _memoGeneration, __ATOMIC_ACQUIRE); \
+		unsigned _memoGlobalGeneration = __atomic_load_n(&CHMemoGeneration_, __ATOMIC_ACQUIRE); \
+		unsigned _memoScope = CHMemoScopeSerial_; \
+		for (unsigned _memoIndex = 0; _memoIndex < CHMemoCacheSize; _memoIndex++) { \
+			__typeof__(&_memoCache.entries_[0]) _memoEntry = &_memoCache.entries_[_memoIndex]; \
+			if (_memoEntry->generation_ == _memoGeneration && _memoEntry->globalGeneration_ == _memoGlobalGeneration && _memoEntry->scope_ == _memoScope && _memoEntry->key_.length_ == _memoKey.length_ && __builtin_memcmp(_memoEntry->key_.bytes_, _memoKey.bytes_, _memoKey.length_) == 0) \
+				return _memoEntry->value_; \
+		} \
+		/* The generations were read before the call, so a result computed across an invalidation is stored already stale */ \
+		return_type _memoValue = $ ## class_name ## _ ## name ## _memoized supercall; \
+		__typeof__(&_memoCache.entries_[0]) _memoEntry = &_memoCache.entries_[_memoCache.next_++ % CHMemoCacheSize]; \
+		_memoEntry->generation_ = _memoGeneration; \
+		_memoEntry->globalGeneration_ = _memoGlobalGeneration; \
+		_memoEntry->scope_ = _memoScope; \
+		_memoEntry->key_.length_ = _memoKey.length_; \
+		__builtin_memcpy(_memoEntry->key_.bytes_, _memoKey.bytes_, _memoKey.length_); \
+		_memoEntry->value_ = _memoValue; \
+		return _memoValue; \
+	} \
+	static return_type $ ## class_name ## _ ## name ## _memoized(class_type self, SEL _cmd, ##args)
+#define CHMemoInvalidate_(class_name, name) \
+	((void)__atomic_add_fetch(&$ ## class_name ## _ ## name ## _memoGeneration, 1, __ATOMIC_RELEASE))
+#define CHMemoInvalidateAll() \
+	((void)__atomic_add_fetch(&CHMemoGeneration_, 1, __ATOMIC_RELEASE))
+#define CHMemoInvalidate(count, args...) CHMemoInvalidate ## count(args)
+#define CHMemoInvalidate0(class, name) CHMemoInvalidate_(class, name)
+#define CHMemoInvalidate1(class, name1) CHMemoInvalidate_(class, name1 ## $)
+#define CHMemoInvalidate2(class, name1, name2) CHMemoInvalidate_(class, name1 ## $ ## name2 ## $)
+#define CHMemoInvalidate3(class, name1, name2, name3) CHMemoInvalidate_(class, name1 ## $ ## name2 ## $ ## name3 ## $)
+#define CHMemoInvalidate4(class, name1, name2, name3, name4) CHMemoInvalidate_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $)
+#define CHMemoInvalidate5(class, name1, name2, name3, name4, name5) CHMemoInvalidate_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $)
+#define CHMemoInvalidate6(class, name1, name2, name3, name4, name5, name6) CHMemoInvalidate_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $)
+#define CHMemoInvalidate7(class, name1, name2, name3, name4, name5, name6, name7) CHMemoInvalidate_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $)
+#define CHMemoInvalidate8(class, name1, name2, name3, name4, name5, name6, name7, name8) CHMemoInvalidate_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $)
+#define CHMemoInvalidate9(class, name1, name2, name3, name4, name5, name6, name7, name8, name9) CHMemoInvalidate_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $)
 #define CHMethod(count, args...) \
 	CHMethod ## count(args)
 #define CHMethod0(return_type, class_type, name) \
@@ -519,7 +1542,477 @@ static inline Class CHLoadClass_(CHClassDeclaration_ *declaration, Class value)
 #define CHClassHook8(class, name1, name2, name3, name4, name5, name6, name7, name8) CHHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $)
 #define CHClassHook9(class, name1, name2, name3, name4, name5, name6, name7, name8, name9) CHHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $)
 
+// Batched Hook Registration (installs many hooks with one runtime update per class where the runtime supports it)
+//	CHDeclareHookBatch(batch, 64);
+//	CHBatchHook(0, batch, UIView, layoutSubviews);
+//	CHBatchHook(1, batch, UIView, setFrame);
+//	CHCommitHookBatch(batch);
+struct CHHookEntry_ {
+	Class class_;
+	SEL selector_;
+	IMP replacement_;
+	IMP *super_;
+	IMP closure_;
+	void (*register_)(void);
+	int *state_;
+	IMP *current_;
+	unsigned *inflight_;
+};
+typedef struct CHHookEntry_ CHHookEntry_;
+#import <stdlib.h>
+#import <string.h>
+struct CHHookBatch_ {
+	CHHookEntry_ *entries_;
+	size_t count_;
+	size_t capacity_;
+	CHHookEntry_ *inline_;
+	size_t inlineCapacity_;
+};
+typedef struct CHHookBatch_ CHHookBatch_;
+#ifndef CHUseSubstrate
+#if defined(__APPLE__) && defined(__clang__)
+#import <Availability.h>
+#if defined(__MAC_10_16) || defined(__IPHONE_14_0)
+#define CHHasBulkMethodRegistration_
+#endif
+#endif
+__attribute__((unused))
+static void CHHookBatchCommitClass_(CHHookEntry_ *entries, size_t count)
+{
+	Class class_ = entries[0].class_;
+	if (!class_)
+		return;
+	SEL names[count];
+	IMP imps[count];
+	const char *types[count];
+	Method methods[count];
+	CHHookEntry_ *pending[count];
+	size_t pendingCount = 0;
+	Class superClass = class_getSuperclass(class_);
+	for (size_t i = 0; i < count; i++) {
+		CHHookEntry_ *entry = &entries[i];
+		Method method = entry->super_ ? class_getInstanceMethod(class_, entry->selector_) : NULL;
+		if (!method) {
+			// New methods and missing ones need the signature, which only the hook's own registration knows
+			entry->register_();
+			continue;
+		}
+		if (!entry->closure_ && superClass && class_getInstanceMethod(superClass, entry->selector_) == method) {
+			// Hooks without a closure (CHMethod_self_) patch the inherited method in place, as CHHook does; a bulk replace would add it to the class instead
+			entry->register_();
+			continue;
+		}
+		CHPublishSuper_(*entry->super_, method_getImplementation(method));
+		names[pendingCount] = entry->selector_;
+		imps[pendingCount] = entry->replacement_;
+		types[pendingCount] = method_getTypeEncoding(method);
+		methods[pendingCount] = method;
+		pending[pendingCount] = entry;
+		pendingCount++;
+	}
+	if (!pendingCount)
+		return;
+#ifdef CHHasBulkMethodRegistration_
+	if (__builtin_available(macOS 11.0, iOS 14.0, tvOS 14.0, watchOS 7.0, *)) {
+		// Methods that are only inherited are added in one pass; the ones that fail to add already live on the class and are replaced in a second
+		size_t addCount = 0;
+		for (size_t i = 0; i < pendingCount; i++)
+			if (pending[i]->closure_) {
+				SEL name = names[i]; names[i] = names[addCount]; names[addCount] = name;
+				IMP imp = imps[i]; imps[i] = imps[addCount]; imps[addCount] = imp;
+				const char *type = types[i]; types[i] = types[addCount]; types[addCount] = type;
+				Method method = methods[i]; methods[i] = methods[addCount]; methods[addCount] = method;
+				CHHookEntry_ *entry = pending[i]; pending[i] = pending[addCount]; pending[addCount] = entry;
+				addCount++;
+			}
+		uint32_t failedCount = 0;
+		SEL *failed = addCount ? class_addMethodsBulk(class_, names, imps, types, (uint32_t)addCount, &failedCount) : NULL;
+		size_t replaceCount = 0;
+		for (size_t i = 0; i < pendingCount; i++) {
+			BOOL added = NO;
+			if (i < addCount) {
+				added = YES;
+				for (uint32_t j = 0; j < failedCount; j++)
+					if (failed[j] == names[i]) {
+						added = NO;
+						break;
+					}
+			}
+			if (added) {
+				CHPublishSuper_(*pending[i]->super_, pending[i]->closure_);
+				*pending[i]->state_ = CHHookStateAdded;
+			} else {
+				*pending[i]->state_ = CHHookStateReplaced;
+#ifdef CHThreadSafeHooks
+				// The bulk replace does not report the IMPs it displaced, so each swap is checked individually; the method is the class's own, the one the bulk replace would update
+				CHReplaceImplementation_(methods[i], imps[i], *pending[i]->super_);
+#else
+				names[replaceCount] = names[i];
+				imps[replaceCount] = imps[i];
+				types[replaceCount] = types[i];
+				replaceCount++;
+#endif
+			}
+		}
+		free(failed);
+		if (replaceCount)
+			class_replaceMethodsBulk(class_, names, imps, types, (uint32_t)replaceCount);
+		return;
+	}
+#endif
+	for (size_t i = 0; i < pendingCount; i++) {
+		CHHookEntry_ *entry = pending[i];
+		if (entry->closure_ && class_addMethod(class_, names[i], imps[i], types[i])) {
+			CHPublishSuper_(*entry->super_, entry->closure_);
+			*entry->state_ = CHHookStateAdded;
+		} else {
+			CHReplaceImplementation_(methods[i], imps[i], *entry->super_);
+			*entry->state_ = CHHookStateReplaced;
+		}
+	}
+}
+#endif
+// Groups entries by class so that each class is updated once
+__attribute__((unused))
+static int CHHookBatchCompare_(const void *left, const void *right)
+{
+	uintptr_t leftClass = (uintptr_t)((const CHHookEntry_ *)left)->class_;
+	uintptr_t rightClass = (uintptr_t)((const CHHookEntry_ *)right)->class_;
+	if (leftClass != rightClass)
+		return leftClass < rightClass ? -1 : 1;
+	uintptr_t leftSelector = (uintptr_t)((const CHHookEntry_ *)left)->selector_;
+	uintptr_t rightSelector = (uintptr_t)((const CHHookEntry_ *)right)->selector_;
+	return leftSelector < rightSelector ? -1 : leftSelector > rightSelector;
+}
+__attribute__((unused))
+static void CHHookBatchSort_(CHHookEntry_ *entries, size_t count)
+{
+	qsort(entries, count, sizeof(CHHookEntry_), CHHookBatchCompare_);
+}
+__attribute__((unused))
+static void CHHookBatchCommit_(CHHookBatch_ *batch)
+{
+	CHHookEntry_ *entries = batch->entries_;
+	size_t count = batch->count_;
+	batch->count_ = 0;
+#ifdef CHUseSubstrate
+	for (size_t i = 0; i < count; i++)
+		entries[i].register_();
+#else
+	CHHookBatchSort_(entries, count);
+	size_t start = 0;
+	for (size_t i = 1; i <= count; i++)
+		if (i == count || entries[i].class_ != entries[start].class_) {
+			CHHookBatchCommitClass_(&entries[start], i - start);
+			start = i;
+		}
+	CHInvalidateSuperCache();
+#endif
+	if (entries != batch->inline_) {
+		free(entries);
+		batch->entries_ = batch->inline_;
+		batch->capacity_ = batch->inlineCapacity_;
+	}
+}
+// Batches that outgrow their declared capacity move to the heap rather than committing early, so that CHSetHookBatchEnabled still sees every entry
+__attribute__((unused))
+static void CHHookBatchGrow_(CHHookBatch_ *batch)
+{
+	size_t capacity = batch->capacity_ ? batch->capacity_ * 2 : 16;
+	CHHookEntry_ *entries;
+	if (batch->entries_ == batch->inline_) {
+		entries = (CHHookEntry_ *)malloc(sizeof(CHHookEntry_) * capacity);
+		memcpy(entries, batch->entries_, sizeof(CHHookEntry_) * batch->count_);
+	} else {
+		entries = (CHHookEntry_ *)realloc(batch->entries_, sizeof(CHHookEntry_) * capacity);
+	}
+	batch->entries_ = entries;
+	batch->capacity_ = capacity;
+}
+__attribute__((unused)) CHInline
+static CHHookEntry_ *CHHookBatchNext_(CHHookBatch_ *batch)
+{
+	if (__builtin_expect(batch->count_ == batch->capacity_, 0))
+		CHHookBatchGrow_(batch);
+	return &batch->entries_[batch->count_++];
+}
+// Batches are static storage like hook declarations, so one declared inside a function must not be filled by two threads at once
+#define CHDeclareHookBatch(batch, capacity) \
+	static CHHookEntry_ batch ## $entries[capacity]; \
+	static CHHookBatch_ batch = { batch ## $entries, 0, capacity, batch ## $entries, capacity }
+#define CHCommitHookBatch(batch) \
+	CHHookBatchCommit_(&(batch))
+
+// Switching hooks on and off in bulk
+//	CHDeclareHookBatch(instrumentation, 256);       // at file scope, so that the entries outlive the function collecting them
+//	CHBatchHook(0, instrumentation, UIView, layoutSubviews); // collected once, never committed
+//	CHSetHookBatchEnabled(instrumentation, YES);     // installs every hook in the batch
+//	CHSetHookBatchEnabled(instrumentation, NO);      // puts the original implementations back
+// Unlike CHCommitHookBatch, this leaves the entries in the batch so that it can be flipped again. A disabled hook costs nothing, as the class dispatches
+// straight to the original implementation; hooks that added a brand-new method stay installed, and like CHUnhook, disabling skips hooks that another hook
+// was layered on top of and returns NO for them (or when CHHookQuiescence times out)
+__attribute__((unused))
+static BOOL CHHookBatchSetEnabled_(CHHookBatch_ *batch, BOOL enabled)
+{
+	CHHookEntry_ *entries = batch->entries_;
+	size_t count = batch->count_;
+	if (!count)
+		return YES;
+	BOOL result = YES;
+#ifdef CHHookQuiescence
+	unsigned *counters[count];
+	size_t waitCount = 0;
+#endif
+	CHHookBatchSort_(entries, count);
+#ifdef CHHasBulkMethodRegistration_
+	BOOL bulk = NO;
+	if (__builtin_available(macOS 11.0, iOS 14.0, tvOS 14.0, watchOS 7.0, *))
+		bulk = YES;
+#endif
+	CHHookEntry_ pending[count];
+	size_t start = 0;
+	for (size_t i = 1; i <= count; i++) {
+		if (i != count && entries[i].class_ == entries[start].class_)
+			continue;
+		Class class_ = entries[start].class_;
+		size_t pendingCount = 0;
+		for (size_t j = start; j < i; j++)
+			if (enabled ? *entries[j].state_ == CHHookStateInactive : (*entries[j].state_ == CHHookStateReplaced || *entries[j].state_ == CHHookStateAdded))
+				pending[pendingCount++] = entries[j];
+		start = i;
+		if (!class_ || !pendingCount)
+			continue;
+		if (enabled) {
+#ifdef CHUseSubstrate
+			for (size_t j = 0; j < pendingCount; j++)
+				pending[j].register_();
+#else
+			CHHookBatchCommitClass_(pending, pendingCount);
+#endif
+			continue;
+		}
+#ifdef CHHasBulkMethodRegistration_
+		SEL names[pendingCount];
+		IMP imps[pendingCount];
+		const char *types[pendingCount];
+		size_t bulkCount = 0;
+#endif
+		for (size_t j = 0; j < pendingCount; j++) {
+			CHHookEntry_ *entry = &pending[j];
+			Method method = class_getInstanceMethod(class_, entry->selector_);
+			if (!method || method_getImplementation(method) != (*entry->current_ ?: entry->replacement_)) {
+				result = NO;
+				continue;
+			}
+			// Added methods cannot be removed; the closure forwards to whatever the superclass implements
+			IMP imp = *entry->state_ == CHHookStateAdded ? entry->closure_ : *entry->super_;
+			*entry->state_ = CHHookStateInactive;
+			*entry->current_ = NULL;
+#ifdef CHHookQuiescence
+			counters[waitCount++] = entry->inflight_;
+#endif
+#ifdef CHHasBulkMethodRegistration_
+			if (bulk) {
+				names[bulkCount] = entry->selector_;
+				imps[bulkCount] = imp;
+				types[bulkCount] = method_getTypeEncoding(method);
+				bulkCount++;
+				continue;
+			}
+#endif
+			method_setImplementation(method, imp);
+		}
+#ifdef CHHasBulkMethodRegistration_
+		if (bulkCount)
+			class_replaceMethodsBulk(class_, names, imps, types, (uint32_t)bulkCount);
+#endif
+	}
+	CHInvalidateSuperCache();
+#ifdef CHHookQuiescence
+	if (waitCount && !CHHookWaitForQuiescence_(counters, waitCount))
+		result = NO;
+#endif
+	return result;
+}
+#define CHSetHookBatchEnabled(batch, enabled) \
+	CHHookBatchSetEnabled_(&(batch), enabled)
+#define CHBatchHook_(batch, class_name, name) \
+	$ ## class_name ## _ ## name ## _entry(CHHookBatchNext_(&(batch)))
+#define CHBatchHook(count, batch, args...) CHBatchHook ## count(batch, args)
+#define CHBatchHook0(batch, class, name) CHBatchHook_(batch, class, name)
+#define CHBatchHook1(batch, class, name1) CHBatchHook_(batch, class, name1 ## $)
+#define CHBatchHook2(batch, class, name1, name2) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $)
+#define CHBatchHook3(batch, class, name1, name2, name3) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $)
+#define CHBatchHook4(batch, class, name1, name2, name3, name4) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $)
+#define CHBatchHook5(batch, class, name1, name2, name3, name4, name5) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $)
+#define CHBatchHook6(batch, class, name1, name2, name3, name4, name5, name6) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $)
+#define CHBatchHook7(batch, class, name1, name2, name3, name4, name5, name6, name7) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $)
+#define CHBatchHook8(batch, class, name1, name2, name3, name4, name5, name6, name7, name8) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $)
+#define CHBatchHook9(batch, class, name1, name2, name3, name4, name5, name6, name7, name8, name9) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $)
+#define CHBatchClassHook(count, batch, args...) CHBatchClassHook ## count(batch, args)
+#define CHBatchClassHook0(batch, class, name) CHBatchHook_(batch, class, name)
+#define CHBatchClassHook1(batch, class, name1) CHBatchHook_(batch, class, name1 ## $)
+#define CHBatchClassHook2(batch, class, name1, name2) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $)
+#define CHBatchClassHook3(batch, class, name1, name2, name3) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $)
+#define CHBatchClassHook4(batch, class, name1, name2, name3, name4) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $)
+#define CHBatchClassHook5(batch, class, name1, name2, name3, name4, name5) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $)
+#define CHBatchClassHook6(batch, class, name1, name2, name3, name4, name5, name6) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $)
+#define CHBatchClassHook7(batch, class, name1, name2, name3, name4, name5, name6, name7) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $)
+#define CHBatchClassHook8(batch, class, name1, name2, name3, name4, name5, name6, name7, name8) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $)
+#define CHBatchClassHook9(batch, class, name1, name2, name3, name4, name5, name6, name7, name8, name9) CHBatchHook_(batch, class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $)
+
+// Removing and replacing hooks at runtime
+//	CHUnhook(1, UIView, setFrame);                       // restores the original implementation; CHHook installs the hook again
+//	CHReplaceHook(1, UIView, setFrame, (IMP)&otherFrame); // otherFrame may call CHSuper(1, UIView, setFrame, frame) to reach the original
+//	CHReplaceHook(1, UIView, setFrame, NULL);            // switches back to the hook's own replacement
+// Both return NO and change nothing when the class no longer dispatches to what the hook installed (another hook was layered on top since).
+// Hooking, unhooking and replacing the same hook must not race each other. With CHHookQuiescence defined, both also wait until no thread is counted inside
+// the replacement that was taken out, and return NO, with the change made, if that does not happen within CHHookQuiescenceTimeout (see Hook Quiescence)
+__attribute__((unused))
+static BOOL CHUnhookEntry_(void (*describe)(CHHookEntry_ *entry))
+{
+	CHHookEntry_ entry;
+	describe(&entry);
+	Method method = entry.class_ ? class_getInstanceMethod(entry.class_, entry.selector_) : NULL;
+	if (!method || method_getImplementation(method) != (*entry.current_ ?: entry.replacement_))
+		return NO;
+	switch (*entry.state_) {
+		case CHHookStateReplaced:
+			method_setImplementation(method, *entry.super_);
+			break;
+		case CHHookStateAdded:
+			// The runtime cannot remove methods; the closure forwards to whatever the superclass implements
+			method_setImplementation(method, entry.closure_);
+			break;
+		default:
+			return NO;
+	}
+	*entry.state_ = CHHookStateInactive;
+	*entry.current_ = NULL;
+	CHInvalidateSuperCache();
+#ifdef CHHookQuiescence
+	return CHHookWaitForQuiescence_(&entry.inflight_, 1);
+#else
+	return YES;
+#endif
+}
+__attribute__((unused))
+static BOOL CHReplaceHookEntry_(void (*describe)(CHHookEntry_ *entry), IMP replacement)
+{
+	CHHookEntry_ entry;
+	describe(&entry);
+	Method method = entry.class_ && *entry.state_ != CHHookStateInactive ? class_getInstanceMethod(entry.class_, entry.selector_) : NULL;
+	IMP expected = *entry.current_ ?: entry.replacement_;
+	if (!method || method_getImplementation(method) != expected)
+		return NO;
+	if (replacement == entry.replacement_)
+		replacement = NULL;
+	method_setImplementation(method, replacement ?: entry.replacement_);
+	*entry.current_ = replacement;
+#ifdef CHHookQuiescence
+	if (expected == entry.replacement_ && replacement)
+		return CHHookWaitForQuiescence_(&entry.inflight_, 1);
+#endif
+	return YES;
+}
+#define CHUnhook_(class_name, name) \
+	CHUnhookEntry_(&$ ## class_name ## _ ## name ## _entry)
+#define CHReplaceHook_(class_name, name, replacement) \
+	CHReplaceHookEntry_(&$ ## class_name ## _ ## name ## _entry, (IMP)(replacement))
+#define CHUnhook(count, args...) CHUnhook ## count(args)
+#define CHUnhook0(class, name) CHUnhook_(class, name)
+#define CHUnhook1(class, name1) CHUnhook_(class, name1 ## $)
+#define CHUnhook2(class, name1, name2) CHUnhook_(class, name1 ## $ ## name2 ## $)
+#define CHUnhook3(class, name1, name2, name3) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $)
+#define CHUnhook4(class, name1, name2, name3, name4) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $)
+#define CHUnhook5(class, name1, name2, name3, name4, name5) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $)
+#define CHUnhook6(class, name1, name2, name3, name4, name5, name6) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $)
+#define CHUnhook7(class, name1, name2, name3, name4, name5, name6, name7) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $)
+#define CHUnhook8(class, name1, name2, name3, name4, name5, name6, name7, name8) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $)
+#define CHUnhook9(class, name1, name2, name3, name4, name5, name6, name7, name8, name9) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $)
+#define CHClassUnhook(count, args...) CHClassUnhook ## count(args)
+#define CHClassUnhook0(class, name) CHUnhook_(class, name)
+#define CHClassUnhook1(class, name1) CHUnhook_(class, name1 ## $)
+#define CHClassUnhook2(class, name1, name2) CHUnhook_(class, name1 ## $ ## name2 ## $)
+#define CHClassUnhook3(class, name1, name2, name3) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $)
+#define CHClassUnhook4(class, name1, name2, name3, name4) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $)
+#define CHClassUnhook5(class, name1, name2, name3, name4, name5) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $)
+#define CHClassUnhook6(class, name1, name2, name3, name4, name5, name6) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $)
+#define CHClassUnhook7(class, name1, name2, name3, name4, name5, name6, name7) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $)
+#define CHClassUnhook8(class, name1, name2, name3, name4, name5, name6, name7, name8) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $)
+#define CHClassUnhook9(class, name1, name2, name3, name4, name5, name6, name7, name8, name9) CHUnhook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $)
+#define CHReplaceHook(count, args...) CHReplaceHook ## count(args)
+#define CHReplaceHook0(class, name, replacement) CHReplaceHook_(class, name, replacement)
+#define CHReplaceHook1(class, name1, replacement) CHReplaceHook_(class, name1 ## $, replacement)
+#define CHReplaceHook2(class, name1, name2, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $, replacement)
+#define CHReplaceHook3(class, name1, name2, name3, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $, replacement)
+#define CHReplaceHook4(class, name1, name2, name3, name4, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $, replacement)
+#define CHReplaceHook5(class, name1, name2, name3, name4, name5, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $, replacement)
+#define CHReplaceHook6(class, name1, name2, name3, name4, name5, name6, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $, replacement)
+#define CHReplaceHook7(class, name1, name2, name3, name4, name5, name6, name7, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $, replacement)
+#define CHReplaceHook8(class, name1, name2, name3, name4, name5, name6, name7, name8, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $, replacement)
+#define CHReplaceHook9(class, name1, name2, name3, name4, name5, name6, name7, name8, name9, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $, replacement)
+#define CHClassReplaceHook(count, args...) CHClassReplaceHook ## count(args)
+#define CHClassReplaceHook0(class, name, replacement) CHReplaceHook_(class, name, replacement)
+#define CHClassReplaceHook1(class, name1, replacement) CHReplaceHook_(class, name1 ## $, replacement)
+#define CHClassReplaceHook2(class, name1, name2, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $, replacement)
+#define CHClassReplaceHook3(class, name1, name2, name3, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $, replacement)
+#define CHClassReplaceHook4(class, name1, name2, name3, name4, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $, replacement)
+#define CHClassReplaceHook5(class, name1, name2, name3, name4, name5, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $, replacement)
+#define CHClassReplaceHook6(class, name1, name2, name3, name4, name5, name6, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $, replacement)
+#define CHClassReplaceHook7(class, name1, name2, name3, name4, name5, name6, name7, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $, replacement)
+#define CHClassReplaceHook8(class, name1, name2, name3, name4, name5, name6, name7, name8, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $, replacement)
+#define CHClassReplaceHook9(class, name1, name2, name3, name4, name5, name6, name7, name8, name9, replacement) CHReplaceHook_(class, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $, replacement)
+
 // Declarative style methods (automatically calls CHHook)
+#ifdef CHImageSection_
+#define CHDeclaredHookSection_ CHImageSection_(chhooks)
+// Each declarative method leaves a record in the image's hook section; a single constructor per image resolves their classes and installs them as one batch
+struct CHDeclaredHook_ {
+	const char *className_;
+	CHClassDeclaration_ *declaration_;
+	void (*entry_)(CHHookEntry_ *entry);
+};
+typedef struct CHDeclaredHook_ CHDeclaredHook_;
+#ifndef __APPLE__
+extern CHDeclaredHook_ __start_chhooks[] __attribute__((weak, visibility("hidden")));
+extern CHDeclaredHook_ __stop_chhooks[] __attribute__((weak, visibility("hidden")));
+#endif
+__attribute__((weak, visibility("hidden"))) int CHDeclaredHooksInstalled_;
+__attribute__((weak, visibility("hidden"), constructor))
+void CHInstallDeclaredHooks_(void)
+{
+	// Every translation unit contributes this constructor, but the linker keeps only one copy
+	if (CHDeclaredHooksInstalled_)
+		return;
+	CHDeclaredHooksInstalled_ = 1;
+#ifdef __APPLE__
+	unsigned long size = 0;
+	CHDeclaredHook_ *hooks = (CHDeclaredHook_ *)getsectiondata(&__dso_handle, "__DATA", "__chhooks", &size);
+	size_t count = size / sizeof(CHDeclaredHook_);
+#else
+	CHDeclaredHook_ *hooks = __start_chhooks;
+	size_t count = hooks ? (size_t)(__stop_chhooks - __start_chhooks) : 0;
+#endif
+	CHDeclareHookBatch(batch, 64);
+	const char *lastName = NULL;
+	Class lastClass = Nil;
+	for (size_t i = 0; i < count; i++) {
+		CHDeclaredHook_ *hook = &hooks[i];
+		if (!lastName || (hook->className_ != lastName && __builtin_strcmp(hook->className_, lastName) != 0)) {
+			lastName = hook->className_;
+			lastClass = objc_getClass(lastName);
+		}
+		CHLoadClass_(hook->declaration_, lastClass);
+		hook->entry_(CHHookBatchNext_(&batch));
+	}
+	CHCommitHookBatch(batch);
+}
+#define CHDeclareMethod_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, args...) \
+	static inline void $ ## class_name ## _ ## name ## _entry(CHHookEntry_ *entry); \
+	static CHDeclaredHook_ $ ## class_name ## _ ## name ## _declared CHDeclaredHookSection_ = { #class_name, &class_name ## $, &$ ## class_name ## _ ## name ## _entry }; \
+	CHMethod_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, ##args)
+#else
 #define CHDeclareMethod_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, args...) \
 	static inline void $ ## class_name ## _ ## name ## _register(); \
 	__attribute__((constructor)) \
@@ -528,6 +2021,7 @@ static inline Class CHLoadClass_(CHClassDeclaration_ *declaration, Class value)
 		$ ## class_name ## _ ## name ## _register(); \
 	} \
 	CHMethod_(return_type, class_type, class_name, class_val, super_class_val, name, sel, sigdef, supercall, ##args)
+#endif
 #define CHDeclareMethod(count, args...) \
 	CHDeclareMethod ## count(args)
 #define CHDeclareMethod0(return_type, class_type, name) \
@@ -573,74 +2067,557 @@ static inline Class CHLoadClass_(CHClassDeclaration_ *declaration, Class value)
 #define CHDeclareClassMethod9(return_type, class_type, name1, type1, arg1, name2, type2, arg2, name3, type3, arg3, name4, type4, arg4, name5, type5, arg5, name6, type6, arg6, name7, type7, arg7, name8, type8, arg8, name9, type9, arg9) \
 	CHDeclareMethod_(return_type, id, class_type, CHMetaClass(class_type), object_getClass(CHMetaClass(class_type)), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $, name1:name2:name3:name4:name5:name6:name7:name8:name9:, CHDeclareSig9_(return_type, type1, type2, type3, type4, type5, type6, type7, type8, type9), (self, _cmd, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9), type1 arg1, type2 arg2, type3 arg3, type4 arg4, type5 arg5, type6 arg6, type7 arg7, type8 arg8, type9 arg9)
 
+// Deferred hooks (installed once the class has been loaded, rather than at launch; useful for classes that live in bundles)
+//	CHDeclareClass(SBIconView);
+//	CHDeferredHooks(SBIconView) {
+//		CHHook(0, SBIconView, layoutSubviews);
+//	}
+#import <pthread.h>
+struct CHDeferredHooks_ {
+	const char *className_;
+	CHClassDeclaration_ *declaration_;
+	void (*install_)(void);
+	struct CHDeferredHooks_ *next_;
+	Class class_;
+};
+typedef struct CHDeferredHooks_ CHDeferredHooks_;
+__attribute__((weak, visibility("hidden"))) CHDeferredHooks_ *CHDeferredHooksPending_;
+__attribute__((weak, visibility("hidden"))) pthread_mutex_t CHDeferredHooksLock_ = PTHREAD_MUTEX_INITIALIZER;
+// Installs every deferred hook whose class has become available; call after loading a bundle on runtimes without image load callbacks
+__attribute__((unused))
+static void CHInstallDeferredHooks()
+{
+	CHDeferredHooks_ *ready = NULL;
+	pthread_mutex_lock(&CHDeferredHooksLock_);
+	CHDeferredHooks_ **link = &CHDeferredHooksPending_;
+	while (*link) {
+		CHDeferredHooks_ *hooks = *link;
+		hooks->class_ = objc_lookUpClass(hooks->className_);
+		if (hooks->class_) {
+			*link = hooks->next_;
+			hooks->next_ = ready;
+			ready = hooks;
+		} else {
+			link = &hooks->next_;
+		}
+	}
+	pthread_mutex_unlock(&CHDeferredHooksLock_);
+	// Installation happens outside the lock so that installers may defer hooks of their own
+	while (ready) {
+		CHDeferredHooks_ *hooks = ready;
+		ready = hooks->next_;
+		CHLoadClass_(hooks->declaration_, hooks->class_);
+		hooks->install_();
+	}
+}
+#ifdef __APPLE__
+#import <mach-o/dyld.h>
+// Installing calls back into the runtime, so this must be a dyld callback: objc_addLoadImageFunc callbacks run while the runtime holds its own lock
+__attribute__((unused))
+static void CHDeferredHooksImageAdded_(const struct mach_header *header, intptr_t slide)
+{
+	// Newly loaded images may carry categories that replace inherited methods
+	CHInvalidateSuperCache();
+	if (CHDeferredHooksPending_)
+		CHInstallDeferredHooks();
+}
+#endif
+__attribute__((weak, visibility("hidden"))) int CHDeferredHooksObserving_;
+__attribute__((unused))
+static void CHRegisterDeferredHooks_(CHDeferredHooks_ *hooks)
+{
+	pthread_mutex_lock(&CHDeferredHooksLock_);
+	hooks->next_ = CHDeferredHooksPending_;
+	CHDeferredHooksPending_ = hooks;
+	int observing = CHDeferredHooksObserving_;
+	CHDeferredHooksObserving_ = 1;
+	pthread_mutex_unlock(&CHDeferredHooksLock_);
+	if (observing)
+		CHInstallDeferredHooks();
+#ifdef __APPLE__
+	// The callback is also invoked for every image that is already loaded
+	else
+		_dyld_register_func_for_add_image(CHDeferredHooksImageAdded_);
+#else
+	else
+		CHInstallDeferredHooks();
+#endif
+}
+#define CHDeferredHooks(name) \
+	static void $ ## name ## _deferredInstall(void); \
+	static CHDeferredHooks_ $ ## name ## _deferred = { #name, &name ## $, &$ ## name ## _deferredInstall, NULL, Nil }; \
+	__attribute__((constructor)) \
+	static void $ ## name ## _deferredConstructor() { \
+		CHRegisterDeferredHooks_(&$ ## name ## _deferred); \
+	} \
+	static void $ ## name ## _deferredInstall(void)
+
+// Shared methods (one replacement installed on many classes; each hooked class keeps its original implementation in a record of its own)
+//	CHSharedMethod(0, void, layoutSubviews) {
+//		CHSharedSuper(0, layoutSubviews);
+//	}
+//	CHSharedHook(0, CHClass(UIButton), layoutSubviews);
+//	CHSharedHook(0, CHClass(UILabel), layoutSubviews);
+// Every hooked class gets a block trampoline of its own that hands the shared body the record of that class, so CHSharedSuper resumes at exactly the implementation the class replaced;
+// a class and its ancestors can all be hooked, and a send on self made by an original implementation starts over at the receiver's class like any other send
+#import <stdlib.h>
+struct CHSharedMethodClass_ {
+	Class class_;
+	IMP original_; // NULL when the class only inherited the method; CHSharedSuper then resolves it from the superclass at call time
+	IMP trampoline_;
+	struct CHSharedMethodClass_ *next_;
+};
+typedef struct CHSharedMethodClass_ CHSharedMethodClass_;
+struct CHSharedMethodTable_ {
+	CHSharedMethodClass_ *classes_;
+	SEL selector_;
+};
+typedef struct CHSharedMethodTable_ CHSharedMethodTable_;
+__attribute__((weak, visibility("hidden"))) pthread_mutex_t CHSharedMethodLock_ = PTHREAD_MUTEX_INITIALIZER;
+// Returns a record for class_, or NULL when it already dispatches to one of the table's trampolines, directly or through an ancestor
+__attribute__((unused))
+static CHSharedMethodClass_ *CHSharedMethodPrepare_(CHSharedMethodTable_ *table, Class class_, SEL selector)
+{
+	if (!class_)
+		return NULL;
+	table->selector_ = selector;
+	Method method = class_getInstanceMethod(class_, selector);
+	if (method) {
+		IMP current = method_getImplementation(method);
+		int covered = 0;
+		pthread_mutex_lock(&CHSharedMethodLock_);
+		for (CHSharedMethodClass_ *record = table->classes_; record && !covered; record = record->next_)
+			covered = record->trampoline_ == current;
+		pthread_mutex_unlock(&CHSharedMethodLock_);
+		if (covered)
+			return NULL;
+	}
+	CHSharedMethodClass_ *record = (CHSharedMethodClass_ *)calloc(1, sizeof(CHSharedMethodClass_));
+	record->class_ = class_;
+	return record;
+}
+__attribute__((unused))
+static void CHSharedMethodInstall_(CHSharedMethodTable_ *table, CHSharedMethodClass_ *record, IMP trampoline, const char *sig)
+{
+	Class class_ = record->class_;
+	SEL selector = table->selector_;
+	record->trampoline_ = trampoline;
+	pthread_mutex_lock(&CHSharedMethodLock_);
+	record->next_ = table->classes_;
+	table->classes_ = record;
+	pthread_mutex_unlock(&CHSharedMethodLock_);
+	Method method = class_getInstanceMethod(class_, selector);
+	if (method) {
+		IMP original = method_getImplementation(method);
+		if (!class_addMethod(class_, selector, trampoline, method_getTypeEncoding(method))) {
+			// The original is published before the trampoline can be reached
+			__atomic_store_n(&record->original_, original, __ATOMIC_RELEASE);
+			IMP previous = method_setImplementation(method, trampoline);
+			if (previous != original)
+				__atomic_store_n(&record->original_, previous, __ATOMIC_RELEASE);
+		}
+	} else {
+		class_addMethod(class_, selector, trampoline, sig);
+	}
+	CHInvalidateSuperCache();
+}
+__attribute__((unused)) CHInline
+static IMP CHSharedMethodSuper_(CHSharedMethodClass_ *record, SEL selector)
+{
+	IMP original = __atomic_load_n(&record->original_, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(original != NULL, 1))
+		return original;
+	return class_getMethodImplementation(class_getSuperclass(record->class_), selector);
+}
+#define CHSharedMethod_(return_type, name, sel, sigdef, supercall, args...) \
+	typedef return_type (*$shared$ ## name ## _type)(id self, SEL _cmd, ##args); \
+	static CHSharedMethodTable_ $shared$ ## name ## _table; \
+	CHMethodSelectorSlot_($shared, name, sel) \
+	static return_type $shared$ ## name ## _body(CHSharedMethodClass_ *_sharedClass, id self, SEL _cmd, ##args); \
+	__attribute__((unused)) \
+	static void $shared$ ## name ## _register(Class class_) { \
+		sigdef; \
+		SEL _cmd = CHMethodSelector_($shared, name, sel); \
+		CHSharedMethodClass_ *_sharedClass = CHSharedMethodPrepare_(&$shared$ ## name ## _table, class_, _cmd); \
+		if (_sharedClass) \
+			CHSharedMethodInstall_(&$shared$ ## name ## _table, _sharedClass, imp_implementationWithBlock(^return_type(id self, ##args) { \
+				return $shared$ ## name ## _body supercall; \
+			}), sig); \
+	} \
+	static return_type $shared$ ## name ## _body(CHSharedMethodClass_ *_sharedClass, id self, SEL _cmd, ##args)
+#define CHSharedMethod(count, args...) \
+	CHSharedMethod ## count(args)
+#define CHSharedMethod0(return_type, name) \
+	CHSharedMethod_(return_type, name, name, CHDeclareSig0_(return_type), (_sharedClass, self, _cmd))
+#define CHSharedMethod1(return_type, name1, type1, arg1) \
+	CHSharedMethod_(return_type, name1 ## $, name1:, CHDeclareSig1_(return_type, type1), (_sharedClass, self, _cmd, arg1), type1 arg1)
+#define CHSharedMethod2(return_type, name1, type1, arg1, name2, type2, arg2) \
+	CHSharedMethod_(return_type, name1 ## $ ## name2 ## $, name1:name2:, CHDeclareSig2_(return_type, type1, type2), (_sharedClass, self, _cmd, arg1, arg2), type1 arg1, type2 arg2)
+#define CHSharedMethod3(return_type, name1, type1, arg1, name2, type2, arg2, name3, type3, arg3) \
+	CHSharedMethod_(return_type, name1 ## $ ## name2 ## $ ## name3 ## $, name1:name2:name3:, CHDeclareSig3_(return_type, type1, type2, type3), (_sharedClass, self, _cmd, arg1, arg2, arg3), type1 arg1, type2 arg2, type3 arg3)
+#define CHSharedMethod4(return_type, name1, type1, arg1, name2, type2, arg2, name3, type3, arg3, name4, type4, arg4) \
+	CHSharedMethod_(return_type, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $, name1:name2:name3:name4:, CHDeclareSig4_(return_type, type1, type2, type3, type4), (_sharedClass, self, _cmd, arg1, arg2, arg3, arg4), type1 arg1, type2 arg2, type3 arg3, type4 arg4)
+#define CHSharedMethod5(return_type, name1, type1, arg1, name2, type2, arg2, name3, type3, arg3, name4, type4, arg4, name5, type5, arg5) \
+	CHSharedMethod_(return_type, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $, name1:name2:name3:name4:name5:, CHDeclareSig5_(return_type, type1, type2, type3, type4, type5), (_sharedClass, self, _cmd, arg1, arg2, arg3, arg4, arg5), type1 arg1, type2 arg2, type3 arg3, type4 arg4, type5 arg5)
+#define CHSharedMethod6(return_type, name1, type1, arg1, name2, type2, arg2, name3, type3, arg3, name4, type4, arg4, name5, type5, arg5, name6, type6, arg6) \
+	CHSharedMethod_(return_type, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $, name1:name2:name3:name4:name5:name6:, CHDeclareSig6_(return_type, type1, type2, type3, type4, type5, type6), (_sharedClass, self, _cmd, arg1, arg2, arg3, arg4, arg5, arg6), type1 arg1, type2 arg2, type3 arg3, type4 arg4, type5 arg5, type6 arg6)
+#define CHSharedMethod7(return_type, name1, type1, arg1, name2, type2, arg2, name3, type3, arg3, name4, type4, arg4, name5, type5, arg5, name6, type6, arg6, name7, type7, arg7) \
+	CHSharedMethod_(return_type, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $, name1:name2:name3:name4:name5:name6:name7:, CHDeclareSig7_(return_type, type1, type2, type3, type4, type5, type6, type7), (_sharedClass, self, _cmd, arg1, arg2, arg3, arg4, arg5, arg6, arg7), type1 arg1, type2 arg2, type3 arg3, type4 arg4, type5 arg5, type6 arg6, type7 arg7)
+#define CHSharedMethod8(return_type, name1, type1, arg1, name2, type2, arg2, name3, type3, arg3, name4, type4, arg4, name5, type5, arg5, name6, type6, arg6, name7, type7, arg7, name8, type8, arg8) \
+	CHSharedMethod_(return_type, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $, name1:name2:name3:name4:name5:name6:name7:name8:, CHDeclareSig8_(return_type, type1, type2, type3, type4, type5, type6, type7, type8), (_sharedClass, self, _cmd, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8), type1 arg1, type2 arg2, type3 arg3, type4 arg4, type5 arg5, type6 arg6, type7 arg7, type8 arg8)
+#define CHSharedMethod9(return_type, name1, type1, arg1, name2, type2, arg2, name3, type3, arg3, name4, type4, arg4, name5, type5, arg5, name6, type6, arg6, name7, type7, arg7, name8, type8, arg8, name9, type9, arg9) \
+	CHSharedMethod_(return_type, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $, name1:name2:name3:name4:name5:name6:name7:name8:name9:, CHDeclareSig9_(return_type, type1, type2, type3, type4, type5, type6, type7, type8, type9), (_sharedClass, self, _cmd, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9), type1 arg1, type2 arg2, type3 arg3, type4 arg4, type5 arg5, type6 arg6, type7 arg7, type8 arg8, type9 arg9)
+#define CHSharedSuper_(name, sel, args...) \
+	(($shared$ ## name ## _type)CHSharedMethodSuper_(_sharedClass, CHMethodSelector_($shared, name, sel)))(self, CHMethodSelector_($shared, name, sel), ##args)
+#define CHSharedSuper(count, args...) \
+	CHSharedSuper ## count(args)
+#define CHSharedSuper0(name) \
+	CHSharedSuper_(name, name)
+#define CHSharedSuper1(name1, val1) \
+	CHSharedSuper_(name1 ## $, name1:, val1)
+#define CHSharedSuper2(name1, val1, name2, val2) \
+	CHSharedSuper_(name1 ## $ ## name2 ## $, name1:name2:, val1, val2)
+#define CHSharedSuper3(name1, val1, name2, val2, name3, val3) \
+	CHSharedSuper_(name1 ## $ ## name2 ## $ ## name3 ## $, name1:name2:name3:, val1, val2, val3)
+#define CHSharedSuper4(name1, val1, name2, val2, name3, val3, name4, val4) \
+	CHSharedSuper_(name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $, name1:name2:name3:name4:, val1, val2, val3, val4)
+#define CHSharedSuper5(name1, val1, name2, val2, name3, val3, name4, val4, name5, val5) \
+	CHSharedSuper_(name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $, name1:name2:name3:name4:name5:, val1, val2, val3, val4, val5)
+#define CHSharedSuper6(name1, val1, name2, val2, name3, val3, name4, val4, name5, val5, name6, val6) \
+	CHSharedSuper_(name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $, name1:name2:name3:name4:name5:name6:, val1, val2, val3, val4, val5, val6)
+#define CHSharedSuper7(name1, val1, name2, val2, name3, val3, name4, val4, name5, val5, name6, val6, name7, val7) \
+	CHSharedSuper_(name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $, name1:name2:name3:name4:name5:name6:name7:, val1, val2, val3, val4, val5, val6, val7)
+#define CHSharedSuper8(name1, val1, name2, val2, name3, val3, name4, val4, name5, val5, name6, val6, name7, val7, name8, val8) \
+	CHSharedSuper_(name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $, name1:name2:name3:name4:name5:name6:name7:name8:, val1, val2, val3, val4, val5, val6, val7, val8)
+#define CHSharedSuper9(name1, val1, name2, val2, name3, val3, name4, val4, name5, val5, name6, val6, name7, val7, name8, val8, name9, val9) \
+	CHSharedSuper_(name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $, name1:name2:name3:name4:name5:name6:name7:name8:name9:, val1, val2, val3, val4, val5, val6, val7, val8, val9)
+#define CHSharedHook_(class_val, name) \
+	$shared$ ## name ## _register(class_val)
+#define CHSharedHook(count, class_val, args...) CHSharedHook ## count(class_val, args)
+#define CHSharedHook0(class_val, name) CHSharedHook_(class_val, name)
+#define CHSharedHook1(class_val, name1) CHSharedHook_(class_val, name1 ## $)
+#define CHSharedHook2(class_val, name1, name2) CHSharedHook_(class_val, name1 ## $ ## name2 ## $)
+#define CHSharedHook3(class_val, name1, name2, name3) CHSharedHook_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $)
+#define CHSharedHook4(class_val, name1, name2, name3, name4) CHSharedHook_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $)
+#define CHSharedHook5(class_val, name1, name2, name3, name4, name5) CHSharedHook_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $)
+#define CHSharedHook6(class_val, name1, name2, name3, name4, name5, name6) CHSharedHook_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $)
+#define CHSharedHook7(class_val, name1, name2, name3, name4, name5, name6, name7) CHSharedHook_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $)
+#define CHSharedHook8(class_val, name1, name2, name3, name4, name5, name6, name7, name8) CHSharedHook_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $)
+#define CHSharedHook9(class_val, name1, name2, name3, name4, name5, name6, name7, name8, name9) CHSharedHook_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $)
+
+// Class Hierarchy (a parent to children index built from a single objc_getClassList scan and reused until an image is loaded or CaptainHook registers a class)
+//	CHSharedHookHierarchy(0, CHClass(UIView), layoutSubviews);
+struct CHClassHierarchy_ {
+	unsigned generation_;
+	int count_;
+	Class *classes_;
+	int *firstChild_;
+	int *nextSibling_;
+	size_t mask_;
+	int *slots_;
+};
+__attribute__((weak, visibility("hidden"))) struct CHClassHierarchy_ *CHClassHierarchyCache_;
+__attribute__((weak, visibility("hidden"))) pthread_mutex_t CHClassHierarchyLock_ = PTHREAD_MUTEX_INITIALIZER;
+__attribute__((weak, visibility("hidden"))) unsigned CHClassHierarchyGeneration_;
+__attribute__((weak, visibility("hidden"))) pthread_once_t CHClassHierarchyObserving_ = PTHREAD_ONCE_INIT;
+// Call after creating or disposing of classes outside of CaptainHook
+#define CHInvalidateClassHierarchy() \
+	((void)__atomic_add_fetch(&CHClassHierarchyGeneration_, 1, __ATOMIC_RELEASE))
+#ifdef __APPLE__
+__attribute__((unused))
+static void CHClassHierarchyImageAdded_(const struct mach_header *header)
+{
+	CHInvalidateClassHierarchy();
+}
+__attribute__((unused))
+static void CHClassHierarchyImageAddedBySlide_(const struct mach_header *header, intptr_t slide)
+{
+	CHInvalidateClassHierarchy();
+}
+#endif
+__attribute__((unused))
+static void CHClassHierarchyObserve_()
+{
+#ifdef __APPLE__
+#if defined(OBJC_ADDLOADIMAGEFUNC_DEFINED) && defined(__clang__)
+	if (__builtin_available(macOS 10.15, iOS 13.0, tvOS 13.0, watchOS 6.0, *))
+		objc_addLoadImageFunc(CHClassHierarchyImageAdded_);
+	else
+#endif
+		_dyld_register_func_for_add_image(CHClassHierarchyImageAddedBySlide_);
+#endif
+}
+__attribute__((unused))
+static int CHClassHierarchyIndex_(struct CHClassHierarchy_ *hierarchy, Class class_)
+{
+	for (size_t i = ((uintptr_t)class_ >> 4) & hierarchy->mask_; hierarchy->slots_[i]; i = (i + 1) & hierarchy->mask_)
+		if (hierarchy->classes_[hierarchy->slots_[i] - 1] == class_)
+			return hierarchy->slots_[i] - 1;
+	return -1;
+}
+__attribute__((unused))
+static void CHClassHierarchyFree_(struct CHClassHierarchy_ *hierarchy)
+{
+	if (hierarchy) {
+		free(hierarchy->classes_);
+		free(hierarchy->firstChild_);
+		free(hierarchy->nextSibling_);
+		free(hierarchy->slots_);
+		free(hierarchy);
+	}
+}
+__attribute__((unused))
+static struct CHClassHierarchy_ *CHClassHierarchyBuild_(unsigned generation)
+{
+	struct CHClassHierarchy_ *hierarchy = (struct CHClassHierarchy_ *)calloc(1, sizeof(struct CHClassHierarchy_));
+	hierarchy->generation_ = generation;
+	// Leave room for classes registered between counting and copying, and copy again if more than that were
+	int allocated = objc_getClassList(NULL, 0) + 64;
+	hierarchy->classes_ = (Class *)malloc(sizeof(Class) * allocated);
+	int count;
+	while ((count = objc_getClassList(hierarchy->classes_, allocated)) > allocated) {
+		allocated = count + 64;
+		hierarchy->classes_ = (Class *)realloc(hierarchy->classes_, sizeof(Class) * allocated);
+	}
+	hierarchy->count_ = count;
+	size_t capacity = 16;
+	while (capacity < (size_t)count * 2)
+		capacity *= 2;
+	hierarchy->mask_ = capacity - 1;
+	hierarchy->slots_ = (int *)calloc(capacity, sizeof(int));
+	hierarchy->firstChild_ = (int *)malloc(sizeof(int) * (count ? count : 1));
+	hierarchy->nextSibling_ = (int *)malloc(sizeof(int) * (count ? count : 1));
+	for (int i = 0; i < count; i++) {
+		size_t slot = ((uintptr_t)hierarchy->classes_[i] >> 4) & hierarchy->mask_;
+		while (hierarchy->slots_[slot])
+			slot = (slot + 1) & hierarchy->mask_;
+		hierarchy->slots_[slot] = i + 1;
+		hierarchy->firstChild_[i] = -1;
+		hierarchy->nextSibling_[i] = -1;
+	}
+	for (int i = 0; i < count; i++) {
+		int parent = CHClassHierarchyIndex_(hierarchy, class_getSuperclass(hierarchy->classes_[i]));
+		if (parent >= 0) {
+			hierarchy->nextSibling_[i] = hierarchy->firstChild_[parent];
+			hierarchy->firstChild_[parent] = i;
+		}
+	}
+	return hierarchy;
+}
+// Returns a malloc'd array of base and every class that inherits from it, parents before children; the caller frees it
+__attribute__((unused))
+static Class *CHCopySubclasses(Class base, int includeBase, size_t *outCount)
+{
+	*outCount = 0;
+	if (!base)
+		return NULL;
+	pthread_once(&CHClassHierarchyObserving_, CHClassHierarchyObserve_);
+	pthread_mutex_lock(&CHClassHierarchyLock_);
+	// Read before building, so that an image loaded during the scan forces another one next time
+	unsigned generation = __atomic_load_n(&CHClassHierarchyGeneration_, __ATOMIC_ACQUIRE);
+	struct CHClassHierarchy_ *hierarchy = CHClassHierarchyCache_;
+#ifdef __APPLE__
+	if (!hierarchy || hierarchy->generation_ != generation) {
+#else
+	// Without image load callbacks, a changed class count also means classes were added
+	if (!hierarchy || hierarchy->generation_ != generation || hierarchy->count_ != objc_getClassList(NULL, 0)) {
+#endif
+		CHClassHierarchyFree_(hierarchy);
+		CHClassHierarchyCache_ = hierarchy = CHClassHierarchyBuild_(generation);
+	}
+	Class *result = NULL;
+	int root = CHClassHierarchyIndex_(hierarchy, base);
+	if (root >= 0) {
+		int *stack = (int *)malloc(sizeof(int) * hierarchy->count_);
+		result = (Class *)malloc(sizeof(Class) * hierarchy->count_);
+		size_t count = 0;
+		int depth = 0;
+		stack[depth++] = root;
+		while (depth) {
+			int index = stack[--depth];
+			if (index != root || includeBase)
+				result[count++] = hierarchy->classes_[index];
+			for (int child = hierarchy->firstChild_[index]; child >= 0; child = hierarchy->nextSibling_[child])
+				stack[depth++] = child;
+		}
+		free(stack);
+		*outCount = count;
+	}
+	pthread_mutex_unlock(&CHClassHierarchyLock_);
+	return result;
+}
+__attribute__((unused))
+static void CHEnumerateSubclasses(Class base, int includeBase, void (*callback)(Class class_, void *context), void *context)
+{
+	size_t count;
+	Class *classes = CHCopySubclasses(base, includeBase, &count);
+	for (size_t i = 0; i < count; i++)
+		callback(classes[i], context);
+	free(classes);
+}
+#define CHSharedHookHierarchy_(class_val, name) \
+	do { \
+		size_t _hierarchyCount; \
+		Class *_hierarchy = CHCopySubclasses(class_val, 1, &_hierarchyCount); \
+		for (size_t _i = 0; _i < _hierarchyCount; _i++) \
+			CHSharedHook_(_hierarchy[_i], name); \
+		free(_hierarchy); \
+	} while(0)
+#define CHSharedHookHierarchy(count, class_val, args...) CHSharedHookHierarchy ## count(class_val, args)
+#define CHSharedHookHierarchy0(class_val, name) CHSharedHookHierarchy_(class_val, name)
+#define CHSharedHookHierarchy1(class_val, name1) CHSharedHookHierarchy_(class_val, name1 ## $)
+#define CHSharedHookHierarchy2(class_val, name1, name2) CHSharedHookHierarchy_(class_val, name1 ## $ ## name2 ## $)
+#define CHSharedHookHierarchy3(class_val, name1, name2, name3) CHSharedHookHierarchy_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $)
+#define CHSharedHookHierarchy4(class_val, name1, name2, name3, name4) CHSharedHookHierarchy_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $)
+#define CHSharedHookHierarchy5(class_val, name1, name2, name3, name4, name5) CHSharedHookHierarchy_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $)
+#define CHSharedHookHierarchy6(class_val, name1, name2, name3, name4, name5, name6) CHSharedHookHierarchy_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $)
+#define CHSharedHookHierarchy7(class_val, name1, name2, name3, name4, name5, name6, name7) CHSharedHookHierarchy_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $)
+#define CHSharedHookHierarchy8(class_val, name1, name2, name3, name4, name5, name6, name7, name8) CHSharedHookHierarchy_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $)
+#define CHSharedHookHierarchy9(class_val, name1, name2, name3, name4, name5, name6, name7, name8, name9) CHSharedHookHierarchy_(class_val, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $)
+
 // Calling super class (or the old method as the case may be)
+// With CHCacheSuperIMP, a hook that was added to a class that only inherited the method keeps calling the superclass IMP it cached until the cache of
+// its image is invalidated: CaptainHook's own hooks and image loads do that, but after anything else changes a superclass's methods (another library
+// swizzling it, method_setImplementation, class_addMethod) CHInvalidateSuperCache() must be called
+#if defined(CHInstrumentHooks) && defined(CHInstrumentHookTiming)
 #define CHSuper_(class_type, _cmd, name, args...) \
-	$ ## class_type ## _ ## name ## _super(self, _cmd, ##args)
+	({ CHHookTimingScope_(_superScope, $ ## class_type ## _ ## name ## _stats.superTicks); CHReadSuper_($ ## class_type ## _ ## name ## _super)(self, _cmd, ##args); })
+#else
+#define CHSuper_(class_type, _cmd, name, args...) \
+	CHReadSuper_($ ## class_type ## _ ## name ## _super)(self, _cmd, ##args)
+#endif
 #define CHSuper(count, args...) \
 	CHSuper ## count(args)
 #define CHSuper0(class_type, name) \
-	CHSuper_(class_type, @selector(name), name)
+	CHSuper_(class_type, CHMethodSelector_(class_type, name, name), name)
 #define CHSuper1(class_type, name1, val1) \
-	CHSuper_(class_type, @selector(name1:), name1 ## $, val1)
+	CHSuper_(class_type, CHMethodSelector_(class_type, name1 ## $, name1:), name1 ## $, val1)
 #define CHSuper2(class_type, name1, val1, name2, val2) \
-	CHSuper_(class_type, @selector(name1:name2:), name1 ## $ ## name2 ## $, val1, val2)
+	CHSuper_(class_type, CHMethodSelector_(class_type, name1 ## $ ## name2 ## $, name1:name2:), name1 ## $ ## name2 ## $, val1, val2)
 #define CHSuper3(class_type, name1, val1, name2, val2, name3, val3) \
-	CHSuper_(class_type, @selector(name1:name2:name3:), name1 ## $ ## name2 ## $ ## name3 ## $, val1, val2, val3)
+	CHSuper_(class_type, CHMethodSelector_(class_type, name1 ## $ ## name2 ## $ ## name3 ## $, name1:name2:name3:), name1 ## $ ## name2 ## $ ## name3 ## $, val1, val2, val3)
 #define CHSuper4(class_type, name1, val1, name2, val2, name3, val3, name4, val4) \
-	CHSuper_(class_type, @selector(name1:name2:name3:name4:), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $, val1, val2, val3, val4)
+	CHSuper_(class_type, CHMethodSelector_(class_type, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $, name1:name2:name3:name4:), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $, val1, val2, val3, val4)
 #define CHSuper5(class_type, name1, val1, name2, val2, name3, val3, name4, val4, name5, val5) \
-	CHSuper_(class_type, @selector(name1:name2:name3:name4:name5:), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $, val1, val2, val3, val4, val5)
+	CHSuper_(class_type, CHMethodSelector_(class_type, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $, name1:name2:name3:name4:name5:), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $, val1, val2, val3, val4, val5)
 #define CHSuper6(class_type, name1, val1, name2, val2, name3, val3, name4, val4, name5, val5, name6, val6) \
-	CHSuper_(class_type, @selector(name1:name2:name3:name4:name5:name6:), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $, val1, val2, val3, val4, val5, val6)
+	CHSuper_(class_type, CHMethodSelector_(class_type, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $, name1:name2:name3:name4:name5:name6:), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $, val1, val2, val3, val4, val5, val6)
 #define CHSuper7(class_type, name1, val1, name2, val2, name3, val3, name4, val4, name5, val5, name6, val6, name7, val7) \
-	CHSuper_(class_type, @selector(name1:name2:name3:name4:name5:name6:name7:), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $, val1, val2, val3, val4, val5, val6, val7)
+	CHSuper_(class_type, CHMethodSelector_(class_type, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $, name1:name2:name3:name4:name5:name6:name7:), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $, val1, val2, val3, val4, val5, val6, val7)
 #define CHSuper8(class_type, name1, val1, name2, val2, name3, val3, name4, val4, name5, val5, name6, val6, name7, val7, name8, val8) \
-	CHSuper_(class_type, @selector(name1:name2:name3:name4:name5:name6:name7:name8:), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $, val1, val2, val3, val4, val5, val6, val7, val8)
+	CHSuper_(class_type, CHMethodSelector_(class_type, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $, name1:name2:name3:name4:name5:name6:name7:name8:), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $, val1, val2, val3, val4, val5, val6, val7, val8)
 #define CHSuper9(class_type, name1, val1, name2, val2, name3, val3, name4, val4, name5, val5, name6, val6, name7, val7, name8, val8, name9, val9) \
-	CHSuper_(class_type, @selector(name1:name2:name3:name4:name5:name6:name7:name8:name9:), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $, val1, val2, val3, val4, val5, val6, val7, val8, val9)
+	CHSuper_(class_type, CHMethodSelector_(class_type, name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $, name1:name2:name3:name4:name5:name6:name7:name8:name9:), name1 ## $ ## name2 ## $ ## name3 ## $ ## name4 ## $ ## name5 ## $ ## name6 ## $ ## name7 ## $ ## name8 ## $ ## name9 ## $, val1, val2, val3, val4, val5, val6, val7, val8, val9)
 
 // Create Class at Runtime (useful for creating subclasses of classes that can't be linked)
-#define CHRegisterClass(name, superName) for (int _tmp = ({ CHClass(name) = objc_allocateClassPair(CHClass(superName), #name, 0); CHMetaClass(name) = object_getClass(CHClass(name)); CHSuperClass(name) = class_getSuperclass(CHClass(name)); 1; }); _tmp; _tmp = ({ objc_registerClassPair(CHClass(name)), 0; }))
-#define CHAlignmentForSize_(size) ({ \
-	size_t s = size; \
-	__builtin_constant_p(s) ? ( \
-		(s) & (1 << 31) ? 31 : \
-		(s) & (1 << 30) ? 30 : \
-		(s) & (1 << 29) ? 29 : \
-		(s) & (1 << 28) ? 28 : \
-		(s) & (1 << 27) ? 27 : \
-		(s) & (1 << 26) ? 26 : \
-		(s) & (1 << 25) ? 25 : \
-		(s) & (1 << 24) ? 24 : \
-		(s) & (1 << 23) ? 23 : \
-		(s) & (1 << 22) ? 22 : \
-		(s) & (1 << 21) ? 21 : \
-		(s) & (1 << 20) ? 20 : \
-		(s) & (1 << 19) ? 19 : \
-		(s) & (1 << 18) ? 18 : \
-		(s) & (1 << 17) ? 17 : \
-		(s) & (1 << 16) ? 16 : \
-		(s) & (1 << 15) ? 15 : \
-		(s) & (1 << 14) ? 14 : \
-		(s) & (1 << 13) ? 13 : \
-		(s) & (1 << 12) ? 12 : \
-		(s) & (1 << 11) ? 11 : \
-		(s) & (1 << 10) ? 10 : \
-		(s) & (1 <<  9) ?  9 : \
-		(s) & (1 <<  8) ?  8 : \
-		(s) & (1 <<  7) ?  7 : \
-		(s) & (1 <<  6) ?  6 : \
-		(s) & (1 <<  5) ?  5 : \
-		(s) & (1 <<  4) ?  4 : \
-		(s) & (1 <<  3) ?  3 : \
-		(s) & (1 <<  2) ?  2 : \
-		(s) & (1 <<  1) ?  1 : \
-		(s) & (1 <<  0) ?  0 : \
-		0 \
-	) : (uint32_t)log2f(s); \
-})
+#define CHRegisterClass(name, superName) for (int _tmp = ({ CHClass(name) = objc_allocateClassPair(CHClass(superName), #name, 0); CHMetaClass(name) = object_getClass(CHClass(name)); CHSuperClass(name) = class_getSuperclass(CHClass(name)); 1; }); _tmp; _tmp = ({ objc_registerClassPair(CHClass(name)); CHInvalidateClassHierarchy(); 0; }))
+
+// Per-instance hooks (hooks installed on a runtime subclass apply only to the objects moved onto it; every other instance keeps its original dispatch)
+//	CHDeclareClass(UIView);
+//	CHDeclareClass(CHTrackedView);
+//	CHMethod(1, void, CHTrackedView, setFrame, CGRect, frame) { ...; CHSuper(1, CHTrackedView, setFrame, frame); }
+//	CHRegisterInstanceHookClass(CHTrackedView, UIView) {
+//		CHHook(1, CHTrackedView, setFrame);
+//	}
+//	CHAttachInstance(view, CHTrackedView);
+//	CHDetachInstance(view, CHTrackedView);
+// The subclass is created once per process; when it already exists the block is skipped. A class of that name that was not created by
+// CHRegisterInstanceHookClass on the same superclass is never adopted: the declaration stays unloaded and CHAttachInstance returns NO.
+// It must not add ivars, and reports its superclass from -class. Objects whose class is not exactly the hooked superclass (such as KVO-observed ones) are not attached
+__attribute__((unused))
+static Class CHInstanceHookClassGetClass_(id self, SEL _cmd)
+{
+	return class_getSuperclass(object_getClass(self));
+}
+// Classes created here carry themselves as an associated object under this key; a selector is the same pointer in every image
+#define CHInstanceHookClassMarker_() \
+	((const void *)sel_registerName("CHInstanceHookClass"))
+__attribute__((unused))
+static int CHInstanceHookClassAllocate_(CHClassDeclaration_ *declaration, Class superClass, const char *name)
+{
+	Class existing = objc_getClass(name);
+	if (existing) {
+		if (class_getSuperclass(existing) == superClass && objc_getAssociatedObject((id)existing, CHInstanceHookClassMarker_()) == (id)existing)
+			CHLoadClass_(declaration, existing);
+		return 0;
+	}
+	if (!superClass)
+		return 0;
+	Class class_ = objc_allocateClassPair(superClass, name, 0);
+	if (!class_)
+		return 0;
+	class_addMethod(class_, @selector(class), (IMP)&CHInstanceHookClassGetClass_, "#@:");
+	CHLoadClass_(declaration, class_);
+	return 1;
+}
+__attribute__((unused))
+static void CHInstanceHookClassRegister_(Class class_)
+{
+	objc_registerClassPair(class_);
+	objc_setAssociatedObject((id)class_, CHInstanceHookClassMarker_(), (id)class_, OBJC_ASSOCIATION_ASSIGN);
+	CHInvalidateClassHierarchy();
+}
+#define CHRegisterInstanceHookClass(name, superName) for (int _tmp = CHInstanceHookClassAllocate_(&name ## $, CHClass(superName), #name); _tmp; _tmp = ({ CHInstanceHookClassRegister_(CHClass(name)); 0; }))
+__attribute__((unused)) CHInline
+static BOOL CHAttachInstance_(id object, CHClassDeclaration_ *declaration)
+{
+	Class class_ = declaration->class_;
+	if (!object || !class_)
+		return NO;
+	Class current = object_getClass(object);
+	if (current == class_)
+		return YES;
+	if (current != declaration->superClass_)
+		return NO;
+	object_setClass(object, class_);
+	return YES;
+}
+__attribute__((unused)) CHInline
+static BOOL CHDetachInstance_(id object, CHClassDeclaration_ *declaration)
+{
+	if (!object || !declaration->class_ || object_getClass(object) != declaration->class_)
+		return NO;
+	object_setClass(object, declaration->superClass_);
+	return YES;
+}
+#define CHAttachInstance(object, name) CHAttachInstance_(object, &name ## $)
+#define CHDetachInstance(object, name) CHDetachInstance_(object, &name ## $)
 #define CHAddIvar(targetClass, name, type) \
-	class_addIvar(targetClass, #name, sizeof(type), CHAlignmentForSize_(sizeof(type)), @encode(type))
+	class_addIvar(targetClass, #name, sizeof(type), __builtin_ctzl(__alignof__(type)), @encode(type))
+
+// Adds a set of ivars ordered to minimise padding and returns the resulting instance size (0 if an ivar could not be added)
+//	CHRegisterClass(MyCell, UITableViewCell) {
+//		size_t size = CHAddIvarsPacked(CHClass(MyCell), CHIvarLayoutEntry(highlighted, BOOL), CHIvarLayoutEntry(frame, CGRect), CHIvarLayoutEntry(count, int));
+//	}
+struct CHIvarLayoutEntry_ {
+	const char *name_;
+	size_t size_;
+	size_t alignment_;
+	const char *type_;
+};
+typedef struct CHIvarLayoutEntry_ CHIvarLayoutEntry_;
+#define CHIvarLayoutEntry(name, type) \
+	{ #name, sizeof(type), __alignof__(type), @encode(type) }
+__attribute__((unused))
+static size_t CHAddIvarsPacked_(Class targetClass, CHIvarLayoutEntry_ *entries, size_t count)
+{
+	// Every size is a multiple of its alignment, so laying out the most aligned ivars first leaves no gaps between them
+	for (size_t i = 1; i < count; i++) {
+		CHIvarLayoutEntry_ entry = entries[i];
+		size_t j = i;
+		for (; j > 0 && entries[j - 1].alignment_ < entry.alignment_; j--)
+			entries[j] = entries[j - 1];
+		entries[j] = entry;
+	}
+	for (size_t i = 0; i < count; i++)
+		if (!class_addIvar(targetClass, entries[i].name_, entries[i].size_, __builtin_ctzl(entries[i].alignment_), entries[i].type_))
+			return 0;
+	return class_getInstanceSize(targetClass);
+}
+#define CHAddIvarsPacked(targetClass, entries...) ({ \
+	CHIvarLayoutEntry_ _ivarLayout[] = { entries }; \
+	CHAddIvarsPacked_(targetClass, _ivarLayout, sizeof(_ivarLayout) / sizeof(_ivarLayout[0])); \
+})
 
 // Retrieve reference to an Ivar value (can read and assign)
 __attribute__((unused)) CHInline
@@ -655,8 +2632,48 @@ static void *CHIvar_(id object, const char *name)
 #endif
 	return NULL;
 }
+// Ivar lookups through CHIvarRef/CHIvar are cached per call site; the offset is reused for any class that resolves to the same ivar
+struct CHIvarCache_ {
+	Class class_;
+	Ivar ivar_;
+	ptrdiff_t offset_;
+};
+typedef struct CHIvarCache_ CHIvarCache_;
+__attribute__((unused))
+static void *CHCachedIvarSlow_(id object, const char *name, CHIvarCache_ *cache, Class class_)
+{
+	Ivar ivar = class_getInstanceVariable(class_, name);
+	if (!ivar)
+		return NULL;
+	ptrdiff_t offset = ivar_getOffset(ivar);
+	Ivar expected = NULL;
+	if (__atomic_compare_exchange_n(&cache->ivar_, &expected, ivar, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		cache->offset_ = offset;
+		__atomic_store_n(&cache->class_, class_, __ATOMIC_RELEASE);
+	} else if (expected == ivar && __atomic_load_n(&cache->class_, __ATOMIC_ACQUIRE)) {
+		// Subclass of a class already cached; only the class hint changes
+		__atomic_store_n(&cache->class_, class_, __ATOMIC_RELEASE);
+	}
+#ifdef CHHasARC
+	return (void *)&((char *)(__bridge void *)object)[offset];
+#else
+	return (void *)&((char *)object)[offset];
+#endif
+}
+__attribute__((unused)) CHInline
+static void *CHCachedIvar_(id object, const char *name, CHIvarCache_ *cache)
+{
+	Class class_ = object_getClass(object);
+	if (__builtin_expect(__atomic_load_n(&cache->class_, __ATOMIC_ACQUIRE) == class_ && class_, 1))
+#ifdef CHHasARC
+		return (void *)&((char *)(__bridge void *)object)[cache->offset_];
+#else
+		return (void *)&((char *)object)[cache->offset_];
+#endif
+	return CHCachedIvarSlow_(object, name, cache, class_);
+}
 #define CHIvarRef(object, name, type) \
-	((type *)CHIvar_(object, #name))
+	((type *)({ static CHIvarCache_ _ivarCache; CHCachedIvar_(object, #name, &_ivarCache); }))
 #define CHIvar(object, name, type) \
 	(*CHIvarRef(object, name, type))
 	// Warning: Dereferences NULL if object is nil or name isn't found. To avoid this save CHIvarRef(...) and test if != NULL
@@ -695,15 +2712,174 @@ static void *CHIvar_(id object, const char *name)
 		CHPropertySetValue(class, name, objVal, OBJC_ASSOCIATION_RETAIN_NONATOMIC); \
 	} while(0)
 
+// Primitive property values live in a side table keyed by object and property and split over CHPrimitivePropertyStripeCount locks, rather than behind the
+// runtime's single association lock. The first set of a property on an object allocates its node and attaches a reaper object under the property's key, whose
+// release when the object is deallocated removes the node; later sets copy into the node in place, and gets never allocate
+#import <stdio.h>
+#import <stdlib.h>
+#ifndef CHPrimitivePropertyStripeCount
+#define CHPrimitivePropertyStripeCount 64 // must be a power of two
+#endif
+struct CHPrimitivePropertyNode_ {
+	uintptr_t object_;
+	const void *key_;
+	struct CHPrimitivePropertyNode_ *next_;
+	unsigned char value_[];
+};
+struct CHPrimitivePropertyStripe_ {
+	pthread_mutex_t lock_;
+	struct CHPrimitivePropertyNode_ **buckets_;
+	size_t mask_;
+	size_t count_;
+};
+__attribute__((weak, visibility("hidden"))) struct CHPrimitivePropertyStripe_ CHPrimitivePropertyStripes_[CHPrimitivePropertyStripeCount];
+__attribute__((weak, visibility("hidden"))) pthread_once_t CHPrimitivePropertyOnce_ = PTHREAD_ONCE_INIT;
+__attribute__((weak, visibility("hidden"))) Class CHPrimitivePropertyReaper_;
+__attribute__((weak, visibility("hidden"))) ptrdiff_t CHPrimitivePropertyReaperObject_;
+__attribute__((weak, visibility("hidden"))) ptrdiff_t CHPrimitivePropertyReaperKey_;
+__attribute__((unused)) CHInline
+static size_t CHPrimitivePropertyHash_(uintptr_t object)
+{
+	return (size_t)((object >> 4) ^ (object >> 12));
+}
+__attribute__((unused)) CHInline
+static struct CHPrimitivePropertyStripe_ *CHPrimitivePropertyStripe_(uintptr_t object)
+{
+	return &CHPrimitivePropertyStripes_[CHPrimitivePropertyHash_(object) & (CHPrimitivePropertyStripeCount - 1)];
+}
+// Returns the link to the node, or to the end of its bucket when there is none; all properties of an object share a bucket
+__attribute__((unused)) CHInline
+static struct CHPrimitivePropertyNode_ **CHPrimitivePropertyFind_(struct CHPrimitivePropertyStripe_ *stripe, uintptr_t object, const void *key)
+{
+	if (!stripe->buckets_)
+		return NULL;
+	struct CHPrimitivePropertyNode_ **link = &stripe->buckets_[(CHPrimitivePropertyHash_(object) / CHPrimitivePropertyStripeCount) & stripe->mask_];
+	while (*link && ((*link)->object_ != object || (*link)->key_ != key))
+		link = &(*link)->next_;
+	return link;
+}
+// Runs while the owner is being deallocated, before its address can be reused
+__attribute__((unused))
+static void CHPrimitivePropertyReaperDealloc_(void *self, SEL _cmd)
+{
+	uintptr_t object = *(uintptr_t *)((char *)self + CHPrimitivePropertyReaperObject_);
+	const void *key = *(const void **)((char *)self + CHPrimitivePropertyReaperKey_);
+	struct CHPrimitivePropertyStripe_ *stripe = CHPrimitivePropertyStripe_(object);
+	pthread_mutex_lock(&stripe->lock_);
+	struct CHPrimitivePropertyNode_ **link = CHPrimitivePropertyFind_(stripe, object, key);
+	struct CHPrimitivePropertyNode_ *node = link ? *link : NULL;
+	if (node) {
+		*link = node->next_;
+		stripe->count_--;
+	}
+	pthread_mutex_unlock(&stripe->lock_);
+	free(node);
+	((void (*)(void *, SEL))class_getMethodImplementation(class_getSuperclass(CHPrimitivePropertyReaper_), _cmd))(self, _cmd);
+}
+__attribute__((unused))
+static void CHPrimitivePropertyInitialize_()
+{
+	for (size_t i = 0; i < CHPrimitivePropertyStripeCount; i++)
+		pthread_mutex_init(&CHPrimitivePropertyStripes_[i].lock_, NULL);
+	// Each image keeps its own table, so each gets its own reaper class
+	char name[64];
+	snprintf(name, sizeof(name), "CHPrimitivePropertyReaper_%lx", (unsigned long)(uintptr_t)&CHPrimitivePropertyStripes_);
+	Class class_ = objc_allocateClassPair(objc_getClass("NSObject"), name, 0);
+	if (class_) {
+		class_addIvar(class_, "object_", sizeof(uintptr_t), __builtin_ctzl(__alignof__(uintptr_t)), "L");
+		class_addIvar(class_, "key_", sizeof(void *), __builtin_ctzl(__alignof__(void *)), "^v");
+		class_addMethod(class_, sel_registerName("dealloc"), (IMP)&CHPrimitivePropertyReaperDealloc_, "v@:");
+		objc_registerClassPair(class_);
+	} else {
+		class_ = objc_getClass(name);
+	}
+	CHPrimitivePropertyReaperObject_ = ivar_getOffset(class_getInstanceVariable(class_, "object_"));
+	CHPrimitivePropertyReaperKey_ = ivar_getOffset(class_getInstanceVariable(class_, "key_"));
+	CHPrimitivePropertyReaper_ = class_;
+}
+// Copies the stored value into value and returns YES, or leaves value untouched and returns NO when the property was never set
+__attribute__((unused))
+static BOOL CHPrimitivePropertyGet_(id object, const void *key, void *value, size_t size)
+{
+	pthread_once(&CHPrimitivePropertyOnce_, CHPrimitivePropertyInitialize_);
+	uintptr_t address = (uintptr_t)object;
+	struct CHPrimitivePropertyStripe_ *stripe = CHPrimitivePropertyStripe_(address);
+	pthread_mutex_lock(&stripe->lock_);
+	struct CHPrimitivePropertyNode_ **link = CHPrimitivePropertyFind_(stripe, address, key);
+	BOOL found = link && *link;
+	if (found)
+		__builtin_memcpy(value, (*link)->value_, size);
+	pthread_mutex_unlock(&stripe->lock_);
+	return found;
+}
+__attribute__((unused))
+static void CHPrimitivePropertySet_(id object, const void *key, const void *value, size_t size)
+{
+	pthread_once(&CHPrimitivePropertyOnce_, CHPrimitivePropertyInitialize_);
+	uintptr_t address = (uintptr_t)object;
+	struct CHPrimitivePropertyStripe_ *stripe = CHPrimitivePropertyStripe_(address);
+	pthread_mutex_lock(&stripe->lock_);
+	struct CHPrimitivePropertyNode_ **link = CHPrimitivePropertyFind_(stripe, address, key);
+	if (link && *link) {
+		__builtin_memcpy((*link)->value_, value, size);
+		pthread_mutex_unlock(&stripe->lock_);
+		return;
+	}
+	if (!stripe->buckets_ || stripe->count_ >= (stripe->mask_ + 1) * 2) {
+		size_t capacity = stripe->buckets_ ? (stripe->mask_ + 1) * 2 : 16;
+		struct CHPrimitivePropertyNode_ **buckets = (struct CHPrimitivePropertyNode_ **)calloc(capacity, sizeof(struct CHPrimitivePropertyNode_ *));
+		if (stripe->buckets_)
+			for (size_t i = 0; i <= stripe->mask_; i++)
+				for (struct CHPrimitivePropertyNode_ *node = stripe->buckets_[i], *next; node; node = next) {
+					next = node->next_;
+					size_t bucket = (CHPrimitivePropertyHash_(node->object_) / CHPrimitivePropertyStripeCount) & (capacity - 1);
+					node->next_ = buckets[bucket];
+					buckets[bucket] = node;
+				}
+		free(stripe->buckets_);
+		stripe->buckets_ = buckets;
+		stripe->mask_ = capacity - 1;
+	}
+	struct CHPrimitivePropertyNode_ *node = (struct CHPrimitivePropertyNode_ *)malloc(sizeof(struct CHPrimitivePropertyNode_) + size);
+	node->object_ = address;
+	node->key_ = key;
+	__builtin_memcpy(node->value_, value, size);
+	link = &stripe->buckets_[(CHPrimitivePropertyHash_(address) / CHPrimitivePropertyStripeCount) & stripe->mask_];
+	node->next_ = *link;
+	*link = node;
+	stripe->count_++;
+	pthread_mutex_unlock(&stripe->lock_);
+	// Only the thread that inserted the node gets here, and the runtime's association calls are kept outside the stripe lock
+	void *reaper = ((void *(*)(Class, SEL))objc_msgSend)(CHPrimitivePropertyReaper_, sel_registerName("new"));
+	*(uintptr_t *)((char *)reaper + CHPrimitivePropertyReaperObject_) = address;
+	*(const void **)((char *)reaper + CHPrimitivePropertyReaperKey_) = key;
+	((void (*)(id, const void *, void *, objc_AssociationPolicy))objc_setAssociatedObject)(object, key, reaper, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+	((void (*)(void *, SEL))objc_msgSend)(reaper, sel_registerName("release"));
+}
+
 // Primitive property equivalent (ie. BOOL, int, structs)
 #define CHPrimitiveProperty(class, type, getter, setter, default) \
 	CHDeclareProperty(class, getter) \
 	CHOptimizedMethod0(new, type, class, getter) { \
-		CHPrimitivePropertyGetValue( class , getter , type , val , default ); \
+		type val = default; \
+		CHPrimitivePropertyGet_(self, &k ## class ## _ ## getter, &val, sizeof(type)); \
 		return val; \
 	} \
 	CHOptimizedMethod1(new, void, class, setter, type, getter) { \
-		CHPrimitivePropertySetValue( class , getter, type , getter ); \
+		CHPrimitivePropertySet_(self, &k ## class ## _ ## getter, &getter, sizeof(type)); \
+	}
+
+// Primitive property stored in a real ivar of a class created with CHRegisterClass
+//	CHRegisterClass(MyView, UIView) {
+//		CHAddIvar(CHClass(MyView), highlighted, BOOL);
+//	}
+//	CHIvarPrimitiveProperty(MyView, BOOL, highlighted, setHighlighted)
+#define CHIvarPrimitiveProperty(class, type, getter, setter) \
+	CHOptimizedMethod0(new, type, class, getter) { \
+		return CHIvar(self, getter, type); \
+	} \
+	CHOptimizedMethod1(new, void, class, setter, type, getter) { \
+		CHIvar(self, getter, type) = getter; \
 	}
 
 #define CHHookProperty(class, getter, setter) \
@@ -721,39 +2897,404 @@ static void CHScopeReleased(id *sro)
 }
 #define CHScopeReleased \
 	__attribute__((cleanup(CHScopeReleased)))
+#endif
 
-#define CHAutoreleasePoolForScope() \
-	NSAutoreleasePool *CHAutoreleasePoolForScope __attribute__((unused)) CHScopeReleased = [[NSAutoreleasePool alloc] init]
+// Autorelease Scopes (use the pool push/pop that @autoreleasepool compiles to, so they work with and without ARC and allocate no pool object)
+//	CHAutoreleaseScope();                   // drains when the enclosing scope ends
+//	CHDeclareAutoreleaseDrain(drain, 256);
+//	for (id item in items) {
+//		CHAutoreleaseDrain(drain);          // drains every 256 iterations, and once more when the scope ends
+//		...
+//	}
+#ifdef __cplusplus
+extern "C" {
+#endif
+void *objc_autoreleasePoolPush(void);
+void objc_autoreleasePoolPop(void *context);
+#ifdef __cplusplus
+}
+#endif
+struct CHAutoreleaseSite_;
+struct CHAutoreleaseScope_ {
+	void *token_;
+	struct CHAutoreleaseSite_ *site_;
+};
+#if defined(CHTrackAutoreleaseHighWater) && defined(__APPLE__)
+// Each scope records an estimate of the most objects it has held when it drains; CHAutoreleaseHighWaterReport() logs them per scope.
+// The estimate is the distance between pool stack positions, so it is only an approximation: it is sampled at the end of the scope (not at its peak), counts
+// the boundaries of pools still open inside it, misses returns the runtime hands over without autoreleasing, and once the pool crosses a page it is only a lower bound
+struct CHAutoreleaseSite_ {
+	const char *function_;
+	int line_;
+	size_t highWater_;
+	int overflowed_;
+	int registered_;
+	struct CHAutoreleaseSite_ *next_;
+};
+__attribute__((weak, visibility("hidden"))) struct CHAutoreleaseSite_ *CHAutoreleaseSites_;
+__attribute__((unused))
+static void CHAutoreleaseRecord_(struct CHAutoreleaseSite_ *site, void *token)
+{
+	// Tokens are positions in the thread's pool stack, so the distance to a fresh one roughly counts the entries pushed since; pages are not contiguous, so
+	// a distance that is negative or larger than a page means the pool grew onto another page and is reported as exceeding what one page holds
+	void *probe = objc_autoreleasePoolPush();
+	uintptr_t distance = (uintptr_t)probe - (uintptr_t)token;
+	objc_autoreleasePoolPop(probe);
+	if (probe < token || distance > 4096) {
+		__atomic_store_n(&site->overflowed_, 1, __ATOMIC_RELAXED);
+		distance = 4096;
+	}
+	size_t count = distance / sizeof(void *) - 1;
+	size_t highWater = __atomic_load_n(&site->highWater_, __ATOMIC_RELAXED);
+	while (count > highWater && !__atomic_compare_exchange_n(&site->highWater_, &highWater, count, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	int expected = 0;
+	if (!__atomic_load_n(&site->registered_, __ATOMIC_RELAXED) && __atomic_compare_exchange_n(&site->registered_, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		struct CHAutoreleaseSite_ *head = __atomic_load_n(&CHAutoreleaseSites_, __ATOMIC_RELAXED);
+		do {
+			site->next_ = head;
+		} while (!__atomic_compare_exchange_n(&CHAutoreleaseSites_, &head, site, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+}
+__attribute__((unused))
+static void CHAutoreleaseHighWaterReport()
+{
+	for (struct CHAutoreleaseSite_ *site = __atomic_load_n(&CHAutoreleaseSites_, __ATOMIC_ACQUIRE); site; site = site->next_)
+		CHLog(@"Autorelease scope in %s:%d: peak of %s%zu objects", site->function_, site->line_, __atomic_load_n(&site->overflowed_, __ATOMIC_RELAXED) ? "more than " : "about ", __atomic_load_n(&site->highWater_, __ATOMIC_RELAXED));
+}
+#define CHAutoreleaseSite_() \
+	({ static struct CHAutoreleaseSite_ _autoreleaseSite = { __FUNCTION__, __LINE__ }; &_autoreleaseSite; })
+#else
+#define CHAutoreleaseHighWaterReport() \
+	CHNothing()
+#define CHAutoreleaseSite_() \
+	NULL
+#endif
+__attribute__((unused)) CHInline
+static void CHAutoreleaseScopeEnd_(struct CHAutoreleaseScope_ *scope)
+{
+#if defined(CHTrackAutoreleaseHighWater) && defined(__APPLE__)
+	CHAutoreleaseRecord_(scope->site_, scope->token_);
 #endif
+	objc_autoreleasePoolPop(scope->token_);
+}
+#define CHAutoreleaseScope() \
+	struct CHAutoreleaseScope_ CHConcat(_autoreleaseScope, __LINE__) __attribute__((unused, cleanup(CHAutoreleaseScopeEnd_))) = { objc_autoreleasePoolPush(), CHAutoreleaseSite_() }
+#define CHAutoreleasePoolForScope() \
+	CHAutoreleaseScope()
+struct CHAutoreleaseDrain_ {
+	struct CHAutoreleaseScope_ scope_;
+	unsigned count_;
+	unsigned interval_;
+};
+__attribute__((unused)) CHInline
+static void CHAutoreleaseDrainEnd_(struct CHAutoreleaseDrain_ *drain)
+{
+	CHAutoreleaseScopeEnd_(&drain->scope_);
+}
+__attribute__((unused)) CHInline
+static void CHAutoreleaseDrainStep_(struct CHAutoreleaseDrain_ *drain)
+{
+	if (++drain->count_ < drain->interval_)
+		return;
+	drain->count_ = 0;
+	CHAutoreleaseScopeEnd_(&drain->scope_);
+	drain->scope_.token_ = objc_autoreleasePoolPush();
+}
+#define CHDeclareAutoreleaseDrain(name, interval) \
+	struct CHAutoreleaseDrain_ name __attribute__((cleanup(CHAutoreleaseDrainEnd_))) = { { objc_autoreleasePoolPush(), CHAutoreleaseSite_() }, 0, interval }
+#define CHAutoreleaseDrain(name) \
+	CHAutoreleaseDrainStep_(&(name))
 
 // Build Assertion
 #define CHBuildAssert(condition) \
 	((void)sizeof(char[1 - 2*!!(condition)]))
 
 // Profiling
+// Each thread aggregates the scopes it runs into counters of its own; CHProfileReport() merges them and logs the statistics of every site (and runs automatically at exit)
 #ifdef CHEnableProfiling
-	#import <mach/mach_time.h>
+	#import <Foundation/NSString.h>
+	#import <pthread.h>
+	#import <stdlib.h>
+	#import <string.h>
+	#ifndef CHProfileSiteCapacity
+		#define CHProfileSiteCapacity 256
+	#endif
+	#ifndef CHProfileLabelCapacity
+		#define CHProfileLabelCapacity 64
+	#endif
+	struct CHProfileCounters_
+	{
+		uint64_t count;
+		uint64_t total;
+		uint64_t minimum;
+		uint64_t maximum;
+		uint64_t histogram[64];
+	};
+	struct CHProfileSite
+	{
+		const char *function;
+		int line;
+		const void *format; // NSString literal of CHProfileScopeWithFormat, only formatted into the report
+		const char *label;
+		int registered;
+		unsigned index;
+		struct CHProfileCounters_ shared; // samples of threads that have exited, and of every thread for sites beyond CHProfileSiteCapacity
+		struct CHProfileSite *labels;
+		unsigned labelCount;
+		struct CHProfileSite *nextLabel;
+		struct CHProfileSite *next;
+	};
+	struct CHProfileThread_
+	{
+		struct CHProfileCounters_ *counters[CHProfileSiteCapacity];
+		struct CHProfileThread_ *next;
+		struct CHProfileThread_ *nextFree;
+	};
 	struct CHProfileData
 	{
-		NSString *message;
+		struct CHProfileSite *site;
 		uint64_t startTime;
 	};
+	__attribute__((weak, visibility("hidden"))) struct CHProfileSite *CHProfileSites_;
+	__attribute__((weak, visibility("hidden"))) struct CHProfileSite *CHProfileSiteTable_[CHProfileSiteCapacity];
+	__attribute__((weak, visibility("hidden"))) unsigned CHProfileSiteCount_;
+	__attribute__((weak, visibility("hidden"))) struct CHProfileThread_ *CHProfileThreads_;
+	__attribute__((weak, visibility("hidden"))) struct CHProfileThread_ *CHProfileFreeThreads_;
+	__attribute__((weak, visibility("hidden"))) pthread_mutex_t CHProfileLock_ = PTHREAD_MUTEX_INITIALIZER;
+	__attribute__((weak, visibility("hidden"))) pthread_key_t CHProfileThreadKey_;
+	__attribute__((weak, visibility("hidden"))) pthread_once_t CHProfileThreadKeyOnce_ = PTHREAD_ONCE_INIT;
+	__attribute__((weak, visibility("hidden"))) __thread struct CHProfileThread_ *CHProfileThreadCurrent_;
+	__attribute__((unused))
+	static void CHProfileAccumulate_(struct CHProfileCounters_ *sum, const struct CHProfileCounters_ *counters)
+	{
+		sum->count += __atomic_load_n(&counters->count, __ATOMIC_RELAXED);
+		sum->total += __atomic_load_n(&counters->total, __ATOMIC_RELAXED);
+		uint64_t minimum = __atomic_load_n(&counters->minimum, __ATOMIC_RELAXED);
+		if (minimum < sum->minimum)
+			sum->minimum = minimum;
+		uint64_t maximum = __atomic_load_n(&counters->maximum, __ATOMIC_RELAXED);
+		if (maximum > sum->maximum)
+			sum->maximum = maximum;
+		for (unsigned i = 0; i < 64; i++)
+			sum->histogram[i] += __atomic_load_n(&counters->histogram[i], __ATOMIC_RELAXED);
+	}
+	__attribute__((unused))
+	static void CHProfileMergeShared_(struct CHProfileCounters_ *shared, const struct CHProfileCounters_ *counters)
+	{
+		__atomic_add_fetch(&shared->count, counters->count, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&shared->total, counters->total, __ATOMIC_RELAXED);
+		for (unsigned i = 0; i < 64; i++)
+			if (counters->histogram[i])
+				__atomic_add_fetch(&shared->histogram[i], counters->histogram[i], __ATOMIC_RELAXED);
+		uint64_t minimum = __atomic_load_n(&shared->minimum, __ATOMIC_RELAXED);
+		while (counters->minimum < minimum && !__atomic_compare_exchange_n(&shared->minimum, &minimum, counters->minimum, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		uint64_t maximum = __atomic_load_n(&shared->maximum, __ATOMIC_RELAXED);
+		while (counters->maximum > maximum && !__atomic_compare_exchange_n(&shared->maximum, &maximum, counters->maximum, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+	__attribute__((unused))
+	static uint64_t CHProfilePercentile_(const struct CHProfileCounters_ *counters, unsigned percent)
+	{
+		// Buckets are powers of two, so this reports the upper bound of the bucket holding the percentile
+		uint64_t target = (counters->count * percent + 99) / 100;
+		uint64_t seen = 0;
+		for (unsigned i = 0; i < 64; i++) {
+			seen += counters->histogram[i];
+			if (seen >= target) {
+				uint64_t bound = i < 63 ? ((uint64_t)2 << i) - 1 : UINT64_MAX;
+				return CHClockTicksToNanoseconds(bound < counters->maximum ? bound : counters->maximum);
+			}
+		}
+		return CHClockTicksToNanoseconds(counters->maximum);
+	}
+	__attribute__((unused))
+	static void CHProfileReport()
+	{
+		pthread_mutex_lock(&CHProfileLock_);
+		for (struct CHProfileSite *site = CHProfileSites_; site; site = site->next) {
+			struct CHProfileCounters_ sum = { 0, 0, UINT64_MAX };
+			CHProfileAccumulate_(&sum, &site->shared);
+			if (site->index < CHProfileSiteCapacity)
+				for (struct CHProfileThread_ *thread = CHProfileThreads_; thread; thread = thread->next) {
+					struct CHProfileCounters_ *counters = __atomic_load_n(&thread->counters[site->index], __ATOMIC_ACQUIRE);
+					if (counters)
+						CHProfileAccumulate_(&sum, counters);
+				}
+			if (!sum.count)
+				continue;
+			const char *label = site->label;
+			if (site->format)
+	#ifdef CHHasARC
+				label = [(__bridge NSString *)site->format UTF8String];
+	#else
+				label = [(NSString *)site->format UTF8String];
+	#endif
+			CHLog(@"Profile %llu calls; min %lluns, mean %lluns, p50 <=%lluns, p90 <=%lluns, p99 <=%lluns, max %lluns; %d in %s%s%s",
+				(unsigned long long)sum.count,
+				(unsigned long long)CHClockTicksToNanoseconds(sum.minimum),
+				(unsigned long long)(CHClockTicksToNanoseconds(sum.total) / sum.count),
+				(unsigned long long)CHProfilePercentile_(&sum, 50),
+				(unsigned long long)CHProfilePercentile_(&sum, 90),
+				(unsigned long long)CHProfilePercentile_(&sum, 99),
+				(unsigned long long)CHClockTicksToNanoseconds(sum.maximum),
+				site->line, site->function, label ? ": " : "", label ? label : "");
+		}
+		pthread_mutex_unlock(&CHProfileLock_);
+	}
+	__attribute__((unused))
+	static void CHProfileRegisterSite_(struct CHProfileSite *site)
+	{
+		// Called with CHProfileLock_ held
+		site->shared.minimum = UINT64_MAX;
+		site->index = CHProfileSiteCount_++;
+		if (site->index < CHProfileSiteCapacity)
+			CHProfileSiteTable_[site->index] = site;
+		site->next = CHProfileSites_;
+		CHProfileSites_ = site;
+		if (!site->next)
+			atexit(CHProfileReport);
+		__atomic_store_n(&site->registered, 1, __ATOMIC_RELEASE);
+	}
+	// Every distinct label of a scope aggregates separately; labels beyond the first CHProfileLabelCapacity are counted with the scope itself
+	__attribute__((unused))
+	static struct CHProfileSite *CHProfileLabelSite_(struct CHProfileSite *site, NSString *label)
+	{
+		if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)) {
+			pthread_mutex_lock(&CHProfileLock_);
+			if (!site->registered)
+				CHProfileRegisterSite_(site);
+			pthread_mutex_unlock(&CHProfileLock_);
+		}
+		if (!label)
+			return site;
+		const char *text = [label UTF8String];
+		for (struct CHProfileSite *labelled = __atomic_load_n(&site->labels, __ATOMIC_ACQUIRE); labelled; labelled = labelled->nextLabel)
+			if (strcmp(labelled->label, text) == 0)
+				return labelled;
+		pthread_mutex_lock(&CHProfileLock_);
+		struct CHProfileSite *labelled = site->labels;
+		while (labelled && strcmp(labelled->label, text) != 0)
+			labelled = labelled->nextLabel;
+		if (!labelled && site->labelCount < CHProfileLabelCapacity) {
+			labelled = (struct CHProfileSite *)calloc(1, sizeof(struct CHProfileSite));
+			labelled->function = site->function;
+			labelled->line = site->line;
+			labelled->label = strdup(text);
+			CHProfileRegisterSite_(labelled);
+			labelled->nextLabel = site->labels;
+			site->labelCount++;
+			__atomic_store_n(&site->labels, labelled, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&CHProfileLock_);
+		return labelled ? labelled : site;
+	}
+	__attribute__((unused)) CHInline
+	static struct CHProfileSite *CHProfileSite_(struct CHProfileSite *site, NSString *label)
+	{
+		if (__builtin_expect(!label && __atomic_load_n(&site->registered, __ATOMIC_ACQUIRE), 1))
+			return site;
+		return CHProfileLabelSite_(site, label);
+	}
+	// A thread's counters are folded into the sites when it exits, and its record is handed to the next thread that profiles
+	__attribute__((unused))
+	static void CHProfileThreadExit_(void *context)
+	{
+		struct CHProfileThread_ *thread = (struct CHProfileThread_ *)context;
+		pthread_mutex_lock(&CHProfileLock_);
+		for (unsigned i = 0; i < CHProfileSiteCapacity; i++) {
+			struct CHProfileCounters_ *counters = thread->counters[i];
+			if (counters && counters->count) {
+				CHProfileMergeShared_(&CHProfileSiteTable_[i]->shared, counters);
+				memset(counters, 0, sizeof(struct CHProfileCounters_));
+				counters->minimum = UINT64_MAX;
+			}
+		}
+		thread->nextFree = CHProfileFreeThreads_;
+		CHProfileFreeThreads_ = thread;
+		pthread_mutex_unlock(&CHProfileLock_);
+		CHProfileThreadCurrent_ = NULL;
+	}
+	__attribute__((unused))
+	static void CHProfileCreateThreadKey_()
+	{
+		pthread_key_create(&CHProfileThreadKey_, CHProfileThreadExit_);
+	}
+	__attribute__((unused))
+	static struct CHProfileCounters_ *CHProfileThreadCounters_(struct CHProfileSite *site)
+	{
+		if (site->index >= CHProfileSiteCapacity)
+			return NULL;
+		struct CHProfileThread_ *thread = CHProfileThreadCurrent_;
+		if (!thread) {
+			pthread_once(&CHProfileThreadKeyOnce_, CHProfileCreateThreadKey_);
+			pthread_mutex_lock(&CHProfileLock_);
+			thread = CHProfileFreeThreads_;
+			if (thread) {
+				CHProfileFreeThreads_ = thread->nextFree;
+			} else {
+				thread = (struct CHProfileThread_ *)calloc(1, sizeof(struct CHProfileThread_));
+				thread->next = CHProfileThreads_;
+				CHProfileThreads_ = thread;
+			}
+			pthread_mutex_unlock(&CHProfileLock_);
+			pthread_setspecific(CHProfileThreadKey_, thread);
+			CHProfileThreadCurrent_ = thread;
+		}
+		struct CHProfileCounters_ *counters = thread->counters[site->index];
+		if (!counters) {
+			counters = (struct CHProfileCounters_ *)calloc(1, sizeof(struct CHProfileCounters_));
+			counters->minimum = UINT64_MAX;
+			__atomic_store_n(&thread->counters[site->index], counters, __ATOMIC_RELEASE);
+		}
+		return counters;
+	}
 	__attribute__((unused)) CHInline
-	static void CHProfileCalculateDurationAndLog_(struct CHProfileData *profileData)
+	static void CHProfileRecord_(struct CHProfileData *profileData)
 	{
-		uint64_t duration = mach_absolute_time() - profileData->startTime;
-		mach_timebase_info_data_t info;
-		mach_timebase_info(&info);
-		duration = (duration * info.numer) / info.denom;
-		CHLog(@"Profile time: %lldns; %@", duration, profileData->message);
+		uint64_t duration = CHClockTicks() - profileData->startTime;
+		struct CHProfileSite *site = profileData->site;
+		struct CHProfileThread_ *thread = CHProfileThreadCurrent_;
+		struct CHProfileCounters_ *counters = thread && site->index < CHProfileSiteCapacity ? thread->counters[site->index] : NULL;
+		if (__builtin_expect(!counters, 0))
+			counters = CHProfileThreadCounters_(site);
+		if (__builtin_expect(!counters, 0)) {
+			struct CHProfileCounters_ sample = { 1, duration, duration, duration };
+			sample.histogram[63 - __builtin_clzll(duration | 1)] = 1;
+			CHProfileMergeShared_(&site->shared, &sample);
+			return;
+		}
+		// Only this thread writes its counters, so they need no read-modify-write; the stores are atomic because CHProfileReport reads them at any time
+		__atomic_store_n(&counters->count, counters->count + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&counters->total, counters->total + duration, __ATOMIC_RELAXED);
+		uint64_t *bucket = &counters->histogram[63 - __builtin_clzll(duration | 1)];
+		__atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+		if (duration < counters->minimum)
+			__atomic_store_n(&counters->minimum, duration, __ATOMIC_RELAXED);
+		if (duration > counters->maximum)
+			__atomic_store_n(&counters->maximum, duration, __ATOMIC_RELAXED);
 	}
+	#define CHProfileScopeWithLabel_(label) \
+		static struct CHProfileSite _profileSite = { __FUNCTION__, __LINE__ }; \
+		struct CHProfileData _profileData __attribute__((cleanup(CHProfileRecord_))) = { CHProfileSite_(&_profileSite, (label)), CHClockTicks() }
 	#define CHProfileScopeWithString(string) \
-		struct CHProfileData _profileData __attribute__((cleanup(CHProfileCalculateDurationAndLog_))) = ({ struct CHProfileData _tmp; _tmp.message = (string); _tmp.startTime = mach_absolute_time(); _tmp; })
+		CHProfileScopeWithLabel_(string)
+	#define CHProfileScope() \
+		CHProfileScopeWithLabel_(nil)
+	// The format is kept by the site and its arguments are not evaluated, so entering the scope formats nothing and looks up no label
+	#ifdef CHHasARC
+		#define CHProfileFormat_(format) (__bridge const void *)(format)
+	#else
+		#define CHProfileFormat_(format) (const void *)(format)
+	#endif
+	#define CHProfileScopeWithFormat(format, args...) \
+		static struct CHProfileSite _profileSite = { __FUNCTION__, __LINE__, CHProfileFormat_(format) }; \
+		struct CHProfileData _profileData __attribute__((cleanup(CHProfileRecord_))) = { CHProfileSite_(&_profileSite, nil), CHClockTicks() }
 #else
+	#define CHProfileReport() \
+		CHNothing()
 	#define CHProfileScopeWithString(string) \
 		CHNothing()
+	#define CHProfileScope() \
+		CHNothing()
+	#define CHProfileScopeWithFormat(format, args...) \
+		CHNothing()
 #endif
-#define CHProfileScopeWithFormat(args...) \
-	CHProfileScopeWithString(([NSString stringWithFormat:args]))
-#define CHProfileScope() \
-	CHProfileScopeWithFormat(@CHStringify(__LINE__) " in %s", __FUNCTION__)
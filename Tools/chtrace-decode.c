@@ -0,0 +1,149 @@
+// Turns a flight recorder file written by a CaptainHook build with CHEnableTracing into a timeline
+//	cc -O2 -o chtrace-decode chtrace-decode.c
+//	chtrace-decode MyTweak.chtrace
+// Prints one line per hook entry (->) or exit (<-): milliseconds since the earliest surviving record, thread and hook,
+// indented by call depth within the thread. Only the most recent records of each thread survive in its ring
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Mirrors the layout in CaptainHook.h
+#define CHTraceMagic 0x52544843
+#define CHTraceVersion 1
+struct CHTraceHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t regionCount;
+	uint32_t regionRecords;
+	uint32_t nameCapacity;
+	uint32_t nameLength;
+	uint32_t nameCount;
+	uint32_t regionsClaimed;
+	uint64_t clockScale;
+	uint64_t startTicks;
+	uint64_t reserved[2];
+};
+struct CHTraceRecord {
+	uint64_t ticks;
+	uint32_t hook;
+	uint32_t event;
+};
+struct CHTraceRegionHeader {
+	uint64_t thread;
+	uint64_t position;
+};
+
+struct CHTraceEvent {
+	uint64_t ticks;
+	uint64_t order;
+	uint32_t region;
+	uint32_t hook;
+	uint32_t event;
+};
+
+static int CHTraceCompareEvents(const void *a, const void *b)
+{
+	const struct CHTraceEvent *left = a;
+	const struct CHTraceEvent *right = b;
+	if (left->ticks != right->ticks)
+		return left->ticks < right->ticks ? -1 : 1;
+	return left->order < right->order ? -1 : left->order > right->order;
+}
+
+static uint64_t CHTraceNanoseconds(uint64_t ticks, uint64_t scale)
+{
+	return (ticks >> 32) * scale + (((ticks & 0xffffffff) * scale) >> 32);
+}
+
+int main(int argc, const char *argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s file.chtrace\n", argv[0]);
+		return 2;
+	}
+	FILE *input = fopen(argv[1], "rb");
+	if (!input) {
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(input, 0, SEEK_END);
+	long size = ftell(input);
+	fseek(input, 0, SEEK_SET);
+	unsigned char *data = size > 0 ? malloc((size_t)size) : NULL;
+	if (!data || fread(data, 1, (size_t)size, input) != (size_t)size) {
+		fprintf(stderr, "%s: could not read file\n", argv[1]);
+		return 1;
+	}
+	fclose(input);
+
+	struct CHTraceHeader header;
+	if ((size_t)size < sizeof(header)) {
+		fprintf(stderr, "%s: not a trace file\n", argv[1]);
+		return 1;
+	}
+	memcpy(&header, data, sizeof(header));
+	if (header.magic != CHTraceMagic) {
+		fprintf(stderr, "%s: not a trace file\n", argv[1]);
+		return 1;
+	}
+	if (header.version != CHTraceVersion) {
+		fprintf(stderr, "%s: trace version %u is not supported (expected %u)\n", argv[1], header.version, CHTraceVersion);
+		return 1;
+	}
+	size_t regionSize = sizeof(struct CHTraceRegionHeader) + (size_t)header.regionRecords * sizeof(struct CHTraceRecord);
+	size_t namesOffset = sizeof(header);
+	size_t regionsOffset = namesOffset + (size_t)header.nameCapacity * header.nameLength;
+	if (!header.regionRecords || (header.regionRecords & (header.regionRecords - 1)) || regionsOffset + (size_t)header.regionCount * regionSize > (size_t)size) {
+		fprintf(stderr, "%s: truncated or corrupt trace file\n", argv[1]);
+		return 1;
+	}
+
+	uint32_t regionCount = header.regionsClaimed < header.regionCount ? header.regionsClaimed : header.regionCount;
+	size_t eventCount = 0;
+	struct CHTraceEvent *events = malloc(sizeof(struct CHTraceEvent) * ((size_t)regionCount * header.regionRecords + 1));
+	uint64_t *threads = malloc(sizeof(uint64_t) * (regionCount + 1));
+	for (uint32_t i = 0; i < regionCount; i++) {
+		const unsigned char *region = data + regionsOffset + (size_t)i * regionSize;
+		struct CHTraceRegionHeader regionHeader;
+		memcpy(&regionHeader, region, sizeof(regionHeader));
+		threads[i] = regionHeader.thread;
+		uint64_t count = regionHeader.position < header.regionRecords ? regionHeader.position : header.regionRecords;
+		for (uint64_t position = regionHeader.position - count; position < regionHeader.position; position++) {
+			struct CHTraceRecord record;
+			memcpy(&record, region + sizeof(regionHeader) + (size_t)(position & (header.regionRecords - 1)) * sizeof(record), sizeof(record));
+			struct CHTraceEvent *event = &events[eventCount++];
+			event->ticks = record.ticks;
+			event->order = position;
+			event->region = i;
+			event->hook = record.hook;
+			event->event = record.event;
+		}
+	}
+	qsort(events, eventCount, sizeof(struct CHTraceEvent), CHTraceCompareEvents);
+
+	unsigned *depths = calloc(regionCount + 1, sizeof(unsigned));
+	uint64_t origin = eventCount ? events[0].ticks : 0;
+	for (size_t i = 0; i < eventCount; i++) {
+		struct CHTraceEvent *event = &events[i];
+		char name[64];
+		const char *hookName = name;
+		if (event->hook && event->hook <= header.nameCapacity && event->hook <= header.nameCount)
+			hookName = (const char *)data + namesOffset + (size_t)(event->hook - 1) * header.nameLength;
+		else
+			snprintf(name, sizeof(name), "hook #%u", event->hook);
+		unsigned *depth = &depths[event->region];
+		if (event->event && *depth)
+			(*depth)--;
+		uint64_t nanoseconds = CHTraceNanoseconds(event->ticks - origin, header.clockScale);
+		printf("%10llu.%06llu  thread %-20llu %*s%s %.*s\n", (unsigned long long)(nanoseconds / 1000000), (unsigned long long)(nanoseconds % 1000000), (unsigned long long)threads[event->region], (int)(*depth * 2), "", event->event ? "<-" : "->", (int)header.nameLength, hookName);
+		if (!event->event)
+			(*depth)++;
+	}
+	free(depths);
+	free(threads);
+	free(events);
+	free(data);
+	return 0;
+}